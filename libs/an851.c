@@ -23,57 +23,77 @@
 #include "an851.h"
 #include "pic18.h"
 #include "serialio.h"
+#include "rimage.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 
-static struct an851_config opts;
-
-static int an851_checksum(struct an851_packet *p);
-static int an851_tx(struct an851_packet *tx,
+static int an851_tx(struct an851_session *s,
+                    struct an851_packet *tx,
                     struct an851_packet *rx);
 
-int
-an851_safe_init(int fd)
+/* Allocate a session for the (already open) TTY fd, with a "safe"
+ * configuration (very generous read/write times) suitable for
+ * identifying the device before it is properly configured with
+ * an851_init. Free with an851_session_free. */
+struct an851_session *
+an851_session_new(int fd)
 {
+    struct an851_session *s;
+    
     if(sio_valid(fd) == -1) {
         rigel_error("AN851 init: cannot set invalid fd!\n");
-        return -1;
+        return NULL;
     }
+    if(!(s = (struct an851_session *)malloc(sizeof(struct an851_session)))) {
+        rigel_error("AN851 init: out of memory!\n");
+        return NULL;
+    }
+    memset(s, 0, sizeof(struct an851_session));
     
-    opts.fd = fd;
+    s->fd = fd;
     
-    opts.rlag = 2;
-    opts.wlag = 5;
-    opts.reset_lag = 1000000;
+    s->rlag = 2;
+    s->wlag = 5;
+    s->reset_lag = 1000000;
+    s->retries = AN851_RETRIES;
     
-    return 0;
+    return s;
+}
+
+void
+an851_session_free(struct an851_session *s)
+{
+    if(s)
+        free(s);
 }
 
 int
-an851_init(int fd, int wlag, int rlag, struct pic18_memory_layout mmap)
+an851_init(struct an851_session *s, int wlag, int rlag,
+           struct pic18_memory_layout mmap)
 {
-    if(sio_valid(fd) == -1) {
+    if(sio_valid(s->fd) == -1) {
         rigel_error("AN851 init: cannot set invalid fd!\n");
         return -1;
     }
-    opts.fd   = fd;
-    opts.mem  = mmap;
+    s->mem  = mmap;
     
-    opts.wlag = wlag;
-    opts.rlag = rlag;
-    opts.reset_lag = 1000000;
+    /* Response times measured so far still hold; the lags only set the
+     * timeouts of commands that haven't been timed yet. */
+    s->wlag = wlag;
+    s->rlag = rlag;
+    s->reset_lag = 1000000;
     
-    opts.lastcmd  = 0;
-    opts.lastaddr = 0x000000;
+    s->lastcmd  = 0;
+    s->lastaddr = 0x000000;
     
     return 0;
 }
 
 int
-an851_rd(byte command, dword address, byte length, void *rx)
+an851_rd(struct an851_session *s, byte command, dword address, byte length, void *rx)
 {
     byte *d;
     int rxlen;
@@ -100,7 +120,7 @@ an851_rd(byte command, dword address, byte length, void *rx)
 
     /* Bubble the error up to give a more descriptive message
      * whereever this function was actually called */
-    if(an851_tx(&rd_command, &rd_data) == -1)
+    if(an851_tx(s, &rd_command, &rd_data) == -1)
         return -1;
 
     d = rd_data.data;
@@ -122,7 +142,7 @@ an851_rd(byte command, dword address, byte length, void *rx)
 }
 
 int
-ifi_run_program(void)
+ifi_run_program(struct an851_session *s)
 {
     struct an851_packet run;
     
@@ -130,11 +150,11 @@ ifi_run_program(void)
     run.data[0] = 0x40;
     run.length  = 1;
     
-    return an851_tx(&run, &run);
+    return an851_tx(s, &run, &run);
 }
 
 int
-ifi_wr_row(dword addr, byte rows, byte val)
+ifi_wr_row(struct an851_session *s, dword addr, byte rows, byte val)
 {
     struct an851_packet wr_row, wr_response;
     
@@ -149,10 +169,10 @@ ifi_wr_row(dword addr, byte rows, byte val)
     wr_row.data[3] = ADDRU(addr);
     wr_row.data[4] = val;
     
-    return an851_tx(&wr_row, &wr_response);
+    return an851_tx(s, &wr_row, &wr_response);
 }
 int
-an851_reset(void)
+an851_reset(struct an851_session *s)
 {
     struct an851_packet reset;
 
@@ -160,8 +180,8 @@ an851_reset(void)
     reset.length = 1;
     reset.data[0] = 0x00;
 
-    an851_tx(&reset, &reset);
-    waitus(opts.reset_lag);
+    an851_tx(s, &reset, &reset);
+    waitus(s->reset_lag);
 
     return 0;
 }
@@ -169,9 +189,10 @@ an851_reset(void)
 /* Read and return the version of the bootloader used. 
  * The version is a 16-bit value - 0xAABB, with AA being
  * the major versinon BB being the minor. The FRC returns
- * 0x0101, or v1.1 */
+ * 0x0101, or v1.1. Any extensions the bootloader has follow the
+ * version (see AN851_CAP_CRC) and are kept in the session. */
 int
-an851_version(void)
+an851_version(struct an851_session *s)
 {
     struct an851_packet version_tx, version_rx;
 
@@ -181,28 +202,118 @@ an851_version(void)
     
     version_tx.data[0] = 0x02;
 
-    if(an851_tx(&version_tx, &version_rx) == -1)
+    if(an851_tx(s, &version_tx, &version_rx) == -1)
         return -1;
 
+    s->caps = (version_rx.length >= 4 && version_rx.data[0] >= 3) ?
+              version_rx.data[3] : 0;
+
     return MAKEWORD(version_rx.data[1], version_rx.data[2]);
 }
 
+static uint32_t
+an851_get32(const byte *d)
+{
+    return d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+/* With AN851_CAP_WRSUM on, the acknowledgement of a write carries the
+ * CRC-32 of what the bootloader reads back from where it wrote; compare
+ * it with the CRC of what we sent. */
+static void
+an851_check_crc(struct an851_session *s, const struct an851_packet *ack,
+                uint32_t crc)
+{
+    if(!(s->mode & AN851_CAP_WRSUM))
+        return;
+    
+    s->write_check = (ack->length >= 4 && an851_get32(ack->data) == crc)
+                     ? AN851_CHECK_OK : AN851_CHECK_BAD;
+}
+
+static void
+an851_check_ack(struct an851_session *s, const struct an851_packet *ack,
+                const void *data, dword length)
+{
+    if(s->mode & AN851_CAP_WRSUM)
+        an851_check_crc(s, ack, rimage_crc(0, data, length));
+}
+
+int
+an851_set_mode(struct an851_session *s, byte flags)
+{
+    struct an851_packet set_mode, ack;
+    
+    set_mode.command = SET_MODE;
+    set_mode.length = 1;
+    set_mode.request_length = 1;
+    set_mode.data[0] = flags;
+    
+    if(an851_tx(s, &set_mode, &ack) == -1 || ack.length < 1)
+        return -1;
+    
+    s->mode = ack.data[0] & flags & s->caps;
+    return s->mode;
+}
+
+int
+an851_rd_crc(struct an851_session *s, dword address, byte blocks,
+             byte count, uint32_t *crcs)
+{
+    int i;
+    byte *d;
+    struct an851_packet rd_crc, rx;
+    
+    if(count > AN851_CRC_MAX) {
+        rigel_error("too many CRCs (%d) for one request!\n", count);
+        return -1;
+    }
+    
+    rd_crc.command = RD_CRC;
+    rd_crc.length = 5;
+    rd_crc.request_length = count;
+    
+    rd_crc.data[0] = count;
+    rd_crc.data[1] = ADDRL(address);
+    rd_crc.data[2] = ADDRH(address);
+    rd_crc.data[3] = ADDRU(address);
+    rd_crc.data[4] = blocks;
+    
+    if(an851_tx(s, &rd_crc, &rx) == -1)
+        return -1;
+    
+    d = rx.data;
+    if(rx.length != 5 + 4 * count || d[0] != count || d[4] != blocks ||
+       ADDRESS(d[1], d[2], d[3]) != address) {
+        rigel_error("Malformed CRC response from device!\n");
+        return -1;
+    }
+    
+    for(i = 0, d += 5; i < count; i++, d += 4)
+        crcs[i] = an851_get32(d);
+    
+    return count;
+}
+
 int
-an851_rd_flash(dword address, byte length, void *flashdata)
+an851_rd_flash(struct an851_session *s, dword address, byte length,
+               void *flashdata)
 {
-    return an851_rd(RD_FLASH, address, length, flashdata);
+    return an851_rd(s, RD_FLASH, address, length, flashdata);
 }
 
 int
-an851_rd_eeprom(word address, byte length, void *eedata)
+an851_rd_eeprom(struct an851_session *s, word address, byte length,
+                void *eedata)
 {
-    return an851_rd(RD_EEDATA, address, length, eedata);
+    return an851_rd(s, RD_EEDATA, address, length, eedata);
 }
 
 int
-an851_rd_config(dword confaddr, byte length, void *configdata)
+an851_rd_config(struct an851_session *s, dword confaddr, byte length,
+                void *configdata)
 {
-    return an851_rd(RD_CONFIG, confaddr, length, configdata);
+    return an851_rd(s, RD_CONFIG, confaddr, length, configdata);
 }
 
 /* Write any number of blocks (8 bytes each) to program (flash) memory.
@@ -211,10 +322,12 @@ an851_rd_config(dword confaddr, byte length, void *configdata)
  * of size blocks * BYTES_PER_BLOCK, you risk reading past the buffer.
  * It is the responsibility of the caller to ensure this alignment. */
 int
-an851_wr_flash(dword address, byte blocks, void *data)
+an851_wr_flash(struct an851_session *s, dword address, byte blocks,
+               void *data)
 {
     struct an851_packet wr_flash, ack;
     dword bytelen = blocks * BYTES_PER_BLOCK;
+    int ret;
     
     wr_flash.command = WR_FLASH;
     wr_flash.length = bytelen + 4;
@@ -227,12 +340,18 @@ an851_wr_flash(dword address, byte blocks, void *data)
 
     memcpy(wr_flash.data + 4, data, bytelen);
     
-    return an851_tx(&wr_flash, &ack);
+    if((ret = an851_tx(s, &wr_flash, &ack)) != -1) {
+        s->write_blocks = blocks;
+        memcpy(s->write_data, data, bytelen);
+        an851_check_ack(s, &ack, data, bytelen);
+    }
+    
+    return ret;
 }
 
 /* Erase rows (64 bytes each) of flash memory starting at address. */
 int
-an851_er_flash(dword address, byte rows)
+an851_er_flash(struct an851_session *s, dword address, byte rows)
 {
     struct an851_packet er_flash, ack;
     
@@ -245,13 +364,15 @@ an851_er_flash(dword address, byte rows)
     er_flash.data[2] = ADDRH(address);
     er_flash.data[3] = ADDRU(address);
 
-    return an851_tx(&er_flash, &ack);
+    return an851_tx(s, &er_flash, &ack);
 }
 
 int
-an851_wr_eeprom(word address, byte length, void *data)
+an851_wr_eeprom(struct an851_session *s, word address, byte length,
+                void *data)
 {
     struct an851_packet wr_eedata, ack;
+    int ret;
 
     wr_eedata.command = WR_EEDATA;
     wr_eedata.length = length + 4;
@@ -264,11 +385,15 @@ an851_wr_eeprom(word address, byte length, void *data)
 
     memcpy(wr_eedata.data + 4, data, length);
     
-    return an851_tx(&wr_eedata, &ack);
+    if((ret = an851_tx(s, &wr_eedata, &ack)) != -1)
+        an851_check_ack(s, &ack, data, length);
+    
+    return ret;
 }
 
 int
-an851_wr_config(byte confaddr, byte length, void *data)
+an851_wr_config(struct an851_session *s, byte confaddr, byte length,
+                void *data)
 {
     struct an851_packet wr_config, ack;
 
@@ -283,86 +408,455 @@ an851_wr_config(byte confaddr, byte length, void *data)
 
     memcpy(wr_config.data + 4, data, length);
 
-    return an851_tx(&wr_config, &ack);
+    return an851_tx(s, &wr_config, &ack);
 }
 
 int
-an851_replicate_write(byte write_command, byte length, dword address)
+an851_replicate_write(struct an851_session *s, byte write_command,
+                      byte length, dword address)
 {
     struct an851_packet wr_command, wr_ack;
+    byte blocks = s->write_blocks;
+    int ret;
 
     wr_command.command = write_command;
-    wr_command.length = 5;
-    wr_command.request_length = length;
+    wr_command.length = 4;
+    wr_command.request_length = (write_command == WR_FLASH) ?
+                                length * BYTES_PER_BLOCK : length;
     
     wr_command.data[0] = length;
     wr_command.data[1] = ADDRL(address);
     wr_command.data[2] = ADDRH(address);
     wr_command.data[3] = ADDRU(address);
 
-    return an851_tx(&wr_command, &wr_ack);
+    /* The buffer still holds the same data afterwards */
+    if((ret = an851_tx(s, &wr_command, &wr_ack)) != -1 &&
+       write_command == WR_FLASH) {
+        s->write_blocks = blocks;
+        an851_check_ack(s, &wr_ack, s->write_data, blocks * BYTES_PER_BLOCK);
+    }
+    
+    return ret;
 }
 
 int
-an851_repeat(void)
+an851_can_replicate(const struct an851_session *s, byte blocks,
+                    const void *data)
+{
+    return s->write_blocks && s->write_blocks == blocks &&
+           memcmp(s->write_data, data, blocks * BYTES_PER_BLOCK) == 0;
+}
+
+int
+an851_repeat(struct an851_session *s)
 {
     struct an851_packet rp_com, rp_ack;
     
-    rp_com.command = opts.lastcmd;
+    rp_com.command = s->lastcmd;
     rp_com.length = 0;
     
-    return an851_tx(&rp_com, &rp_ack);
+    return an851_tx(s, &rp_com, &rp_ack);
+}
+
+/* Start (or restart) decoding a frame into pkt. */
+void
+an851_decoder_init(struct an851_decoder *dec, struct an851_packet *pkt)
+{
+    dec->state = AN851_RX_IDLE;
+    dec->count = 0;
+    dec->sum   = 0;
+    dec->pkt   = pkt;
 }
 
+/* Feed one received byte to the decoder. Bytes outside of a frame are
+ * dropped, and an unescaped STX anywhere restarts the frame, so the
+ * decoder resynchronises on the next frame by itself. On the closing ETX
+ * the frame has already been unescaped and checksummed:
+ * pkt->command holds the command, pkt->data/pkt->length the data that
+ * followed it and pkt->checksum the checksum byte. */
 int
-an851_wait_response(byte *buf, size_t max)
+an851_decoder_feed(struct an851_decoder *dec, byte c)
 {
-    int prev, wait = 0;
-    int recv = sio_read(opts.fd, buf, max);
+    switch(dec->state) {
+    case AN851_RX_IDLE:
+        if(c == STX)
+            dec->state = AN851_RX_DATA;
+        return AN851_RX_MORE;
     
-    if(!recv) return 0;
-    if(recv == -1) return -1;
+    case AN851_RX_ESCAPE:
+        dec->state = AN851_RX_DATA;
+        break;
     
-    while(!(buf[recv-1] == ETX && buf[recv-2] != DLE)) {
-        prev  = recv;
-        recv += sio_read(opts.fd, &buf[recv], max-recv);
+    case AN851_RX_DATA:
+        if(c == STX) {
+            dec->count = dec->sum = 0;
+            return AN851_RX_MORE;
+        }
+        if(c == DLE) {
+            dec->state = AN851_RX_ESCAPE;
+            return AN851_RX_MORE;
+        }
+        if(c == ETX) {
+            dec->state = AN851_RX_IDLE;
+            
+            /* We need at least the command and the checksum, and
+             * the checksum makes all the bytes sum up to zero. */
+            if(dec->count < 2 || dec->sum != 0)
+                return AN851_RX_ERROR;
+            
+            dec->pkt->length   = dec->count - 2;
+            dec->pkt->checksum = dec->pkt->data[dec->pkt->length];
+            return AN851_RX_FRAME;
+        }
+        break;
+    }
+    
+    /* Plain (or escaped) data byte */
+    if(dec->count > MAX_PACKET_SIZE) {
+        dec->state = AN851_RX_IDLE;
+        return AN851_RX_ERROR;
+    }
+    
+    if(dec->count == 0)
+        dec->pkt->command = c;
+    else dec->pkt->data[dec->count - 1] = c;
+    
+    dec->count++;
+    dec->sum += c;
+    
+    return AN851_RX_MORE;
+}
+
+/* Frame command and length bytes of data for transmission into out:
+ * <STX><STX><Command><Data><Checksum><ETX>, escaping control characters
+ * and computing the checksum on the way. out must have room for
+ * AN851_FRAME_SIZE(length) bytes. Returns the number of bytes used. */
+int
+an851_encode(byte command, const byte *data, int length, byte *out)
+{
+    int i, n = 0;
+    byte chk = command;
+    
+    out[n++] = STX;
+    out[n++] = STX;
+    
+    if(IS_CONTROL(command))
+        out[n++] = DLE;
+    out[n++] = command;
+    
+    for(i = 0; i < length; i++) {
+        if(IS_CONTROL(data[i]))
+            out[n++] = DLE;
+        out[n++] = data[i];
+        chk += data[i];
+    }
+    
+    chk = (~chk + 1) & 0xFF;
+    if(IS_CONTROL(chk))
+        out[n++] = DLE;
+    out[n++] = chk;
+    
+    out[n++] = ETX;
+    
+    return n;
+}
+
+void
+an851_drain(struct an851_session *s)
+{
+    byte buf[MAX_PACKET_SIZE * 2];
+    struct timespec deadline;
+    
+    do sio_deadline(&deadline, SERIAL_GRACE_TIMEOUT / 1000);
+    while(sio_read_until(s->fd, buf, sizeof(buf), &deadline) > 0);
+}
+
+/* Decode the response frame carrying the command ack into rx, returning
+ * as soon as its closing ETX arrives. A response must also start with the
+ * echolen bytes at echo, which reads repeat from their requests. Frames
+ * that don't are late answers to earlier requests, and are skipped, as
+ * are frames for any other command. Gives up when the
+ * absolute deadline passes: returns 0 if nothing at all was received, -1
+ * on a partial or corrupt frame or I/O error, and the size of the
+ * unescaped frame otherwise. */
+int
+an851_wait_response(struct an851_session *s, struct an851_packet *rx,
+                    byte ack, const byte *echo, int echolen,
+                    const struct timespec *deadline)
+{
+    int i, len, recv = 0;
+    byte buf[MAX_PACKET_SIZE * 2];
+    struct an851_decoder dec;
+    struct an851_stats *st = &s->stats[AN851_SLOT(s->lastcmd)];
+    
+    an851_decoder_init(&dec, rx);
+    
+    for(;;) {
+        len = sio_read_until(s->fd, buf, sizeof(buf), deadline);
+        if(len == -1)
+            return -1;
+        if(len == 0) {
+            st->timeouts++;
+            return recv ? -1 : 0;
+        }
         
-        if(prev - recv == 0)
-             wait++;
-        else wait = 0;
+        recv += len;
+        st->wire_rx += len;
+        for(i = 0; i < len; i++) {
+            switch(an851_decoder_feed(&dec, buf[i])) {
+            case AN851_RX_FRAME:
+                st->raw_rx += dec.count;
+                if(rx->command != ack || rx->length < echolen ||
+                   memcmp(rx->data, echo, echolen) != 0) {
+                    recv = len - i - 1;
+                    continue;
+                }
+                
+                /* Nothing should follow the answer; whatever does is
+                 * stale, and must not be taken for the next one. */
+                if(i + 1 < len)
+                    an851_drain(s);
+                return dec.count;
+                
+            case AN851_RX_ERROR:
+                st->bad_frames++;
+                rigel_error("corrupt response frame from device!\n");
+                return -1;
+            }
+        }
+    }
+}
+
+/* The timeout for a command before anything has been measured, in
+ * milliseconds, from the lags configured with an851_init. */
+static long
+an851_lag(const struct an851_session *s, const struct an851_packet *tx)
+{
+    switch(tx->command) {
+    case RD_FLASH:
+    case RD_CONFIG:
+    case RD_EEDATA:
+    case RD_VERSION:
+    case RD_CRC:
+    case RD_RANGE:
+        return s->rlag * tx->request_length;
+    
+    case WR_FLASH:
+    case WR_CONFIG:
+    case WR_EEDATA:
+    case IFI_WR_ROW:
+        return s->wlag * tx->request_length;
+    
+    case ER_FLASH:
+        return s->wlag * 0xFF;
         
-        /* If we don't read anything twice in a row, it's
-         * pretty clear we didn't get a response. */
-        if(wait >= 2)
-            return -1;
+    default:
+        return 0;
+    }
+}
+
+/* The round trip time, in nanoseconds, that r predicts for a request of
+ * units units. Until requests of different lengths have been measured,
+ * the fixed and per unit costs can't be told apart; the mean round trip
+ * is then taken for shorter requests and scaled up for longer ones. */
+static int64_t
+an851_rtt_predict(const struct an851_rtt *r, long units)
+{
+    double spread = r->units2 - r->units * r->units, slope, fixed;
+    
+    if(spread < 1.0)
+        return r->time * max(units, r->units) / r->units;
+    
+    slope = (r->units_time - r->units * r->time) / spread;
+    fixed = r->time - slope * r->units;
+    if(slope < 0) {
+        slope = 0;
+        fixed = r->time;
+    } else if(fixed < 0) {
+        slope = r->time / r->units;
+        fixed = 0;
+    }
+    
+    return fixed + slope * units;
+}
+
+/* How long to wait for the response to tx, in microseconds. Once a
+ * command has been timed, this is the round trip time predicted for its
+ * request_length plus four times the variation [RFC 6298], doubled for
+ * every timeout since the last good measurement. */
+static long
+an851_rto(const struct an851_session *s, const struct an851_packet *tx)
+{
+    long units = max(1, tx->request_length), rto;
+    const struct an851_rtt *r;
+    
+    r = &s->rtt[AN851_SLOT(tx->command)];
+    
+    if(r->n)
+        rto = max(AN851_RTO_MIN,
+                  an851_rtt_predict(r, units) * (1 + 4 * r->rttvar) / 1000);
+    else rto = an851_lag(s, tx) * 1000;
+    
+    return rto << r->backoff;
+}
+
+/* Feed the round trip time of a response (in nanoseconds) that came back
+ * on the first try into the estimator. Responses to retransmitted requests
+ * are never measured, since we can't tell which request they answer. */
+static void
+an851_rtt_sample(struct an851_session *s, const struct an851_packet *tx,
+                 int64_t elapsed)
+{
+    struct an851_rtt *r = &s->rtt[AN851_SLOT(tx->command)];
+    double units = max(1, tx->request_length), time = max(1, elapsed);
+    double predicted, error;
+    
+    if(!r->n) {
+        r->units      = units;
+        r->time       = time;
+        r->units2     = units * units;
+        r->units_time = units * time;
+        r->rttvar     = 0.5;
+    } else {
+        predicted = max(1, an851_rtt_predict(r, units));
+        error = (time > predicted ? time - predicted : predicted - time);
+        r->rttvar = (3 * r->rttvar + error / predicted) / 4;
+        
+        r->units      = (7 * r->units + units) / 8;
+        r->time       = (7 * r->time + time) / 8;
+        r->units2     = (7 * r->units2 + units * units) / 8;
+        r->units_time = (7 * r->units_time + units * time) / 8;
     }
-    return recv;
+    r->n++;
+    r->backoff = 0;
+}
+
+static int64_t
+an851_elapsed(const struct timespec *since)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - since->tv_sec) * 1000000000 +
+           (now.tv_nsec - since->tv_nsec);
 }
+
+/* Account for a request answered after us microseconds */
+static void
+an851_time(struct an851_stats *st, int64_t us)
+{
+    int b = 0;
     
+    st->time += us;
+    while(us > 1 && b < AN851_HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    st->hist[b]++;
+}
+
+/* How many bytes of the request tx its response starts with */
 static int
-an851_checksum(struct an851_packet * p)
+an851_echo(const struct an851_packet *tx)
 {
-    int c, chk;
+    switch(tx->command) {
+    case RD_FLASH:
+    case RD_CONFIG:
+    case RD_EEDATA:
+        return 4;
+    
+    case RD_CRC:
+        return 5;
+    
+    default:
+        return 0;
+    }
+}
 
-    chk = p->command;
-    for(c = 0; c < p->length; c++)
-        chk += p->data[c];
+/* Send a framed request (of transmit_len bytes) for tx and wait for its
+ * response in rx, which must carry the command ack, retransmitting the
+ * request as needed. Only the command, length and request_length of tx
+ * are used, and for reads, the data their responses repeat. */
+static int
+an851_send(struct an851_session *s, const struct an851_packet *tx,
+           const byte *frame, int transmit_len, byte ack,
+           struct an851_packet *rx)
+{
+    int recv_len, retry = 0;
+    struct timespec first, sent, deadline;
+    struct an851_stats *st;
+    struct an851_rtt *r;
+    long rto;
+    
+    s->lastcmd = tx->command;
+    
+    /* Whatever this is overwrites the bootloader's buffer */
+    s->write_blocks = 0;
+    s->write_check = AN851_CHECK_NONE;
+    
+    st = &s->stats[AN851_SLOT(tx->command)];
+    r  = &s->rtt[AN851_SLOT(tx->command)];
+    st->requests++;
+    st->raw_tx += tx->length + 2;
+    clock_gettime(CLOCK_MONOTONIC, &first);
+    
+__retry:
+    clock_gettime(CLOCK_MONOTONIC, &sent);
+    if(sio_write(s->fd, frame, transmit_len) == -1) {
+        rigel_error("I/O error transmitting data to PIC!");
+        return -1;
+    }
+    st->wire_tx += transmit_len;
+    
+    /* These commands do not have responses */
+    if(tx->command == PIC_RESET || tx->command == IFI_RUN_CODE)
+        return 0;
+    
+    /* The whole response must arrive by the deadline, which allows
+     * a grace period for our device to receive and process the request.
+     * When we don't get a proper reponse, we back off and retry (up to
+     * 3 times by default). If we still don't succeed, bail out. */
+    rto = an851_rto(s, tx);
+    sio_deadline(&deadline, (rto + SERIAL_GRACE_TIMEOUT) / 1000);
+    recv_len = an851_wait_response(s, rx, ack, tx->data, an851_echo(tx),
+                                   &deadline);
+    if(recv_len <= 0) {
+        if(r->backoff < AN851_MAX_BACKOFF)
+            r->backoff++;
         
-    return ((~chk + 1) & 0xFF);
+        if(retry < s->retries) {
+            retry++;
+            st->retries++;
+            
+            /* The answer to the last try may just be late; it mustn't
+             * be read as the answer to the next. */
+            an851_drain(s);
+            goto __retry;
+        }
+        return -1;
+    }
+    
+    /* After a retry, the answers to the earlier tries may still come in
+     * behind this one. */
+    if(retry == 0)
+        an851_rtt_sample(s, tx, an851_elapsed(&sent));
+    else an851_drain(s);
+    an851_time(st, an851_elapsed(&first) / 1000);
+
+    return retry;
 }
 
 static int
-an851_tx(struct an851_packet *tx, struct an851_packet *rx)
+an851_tx(struct an851_session *s, struct an851_packet *tx,
+         struct an851_packet *rx)
 {
-    int i;
-    int transmit_len, datalen, recv_len, retry = 0;
-    static byte buffer[MAX_PACKET_SIZE * 2];
+    int transmit_len;
     
     if(!tx || !rx) {
         rigel_error("invalid argument!\n");
         return -1;
     }    
-    if(sio_valid(opts.fd) == -1) {
+    if(sio_valid(s->fd) == -1) {
         rigel_error("fd invalid!\n");
         return -1;
     }
@@ -372,134 +866,206 @@ an851_tx(struct an851_packet *tx, struct an851_packet *rx)
         return -1;
     }
     
-__retry:    
-    datalen = transmit_len = recv_len = 0;    
-    opts.lastcmd = tx->command;
-    tx->checksum = an851_checksum(tx);
+    transmit_len = an851_encode(tx->command, tx->data, tx->length, s->buffer);
     
-    /* Start our packet off with 2 * STX (start of text)
-     * <STX><STX><Command><DataLength><Data><Checksum><ETX> */
-    buffer[0] = STX;
-    buffer[1] = STX;
+    return an851_send(s, tx, s->buffer, transmit_len, tx->command, rx);
+}
+
+int
+an851_tx_frame(struct an851_session *s, const struct an851_packet *tx,
+               const uint8_t *frame, int length, uint8_t ack, uint32_t crc)
+{
+    int retries;
+    struct an851_packet rx;
     
-    if(IS_CONTROL(tx->command)) {
-        buffer[2] = DLE;
-        buffer[3] = tx->command;
-        transmit_len = 4;
-    } else {
-        buffer[2] = tx->command;
-        transmit_len = 3;
+    if(sio_valid(s->fd) == -1) {
+        rigel_error("fd invalid!\n");
+        return -1;
     }
+    
+    retries = an851_send(s, tx, frame, length, ack, &rx);
+    if(retries != -1 && tx->command == WR_FLASH)
+        an851_check_crc(s, &rx, crc);
+    
+    return retries;
+}
 
-    /* Escape all control characters within the data as we copy */
-    for(i = 0; i < tx->length; i++, transmit_len++) {
-        if(IS_CONTROL(tx->data[i])) {
-            buffer[transmit_len] = DLE;
-            transmit_len++;
+/* Take the frames of an RD_RANGE response as they stream in, starting
+ * at data + *done, and count the bytes that arrive in *done. Bytes read
+ * past the end of one frame are the start of the next, so the decoder
+ * carries on over them. Returns 0 once everything is in, or -1 when the
+ * stream stops or goes wrong. */
+static int
+an851_rx_range(struct an851_session *s, const struct an851_packet *tx,
+               dword address, dword length, byte *data, dword *done)
+{
+    int i, len, first = 1;
+    byte buf[MAX_PACKET_SIZE * 2], *d;
+    dword n;
+    struct an851_packet rx;
+    struct an851_decoder dec;
+    struct an851_stats *st = &s->stats[AN851_SLOT(RD_RANGE)];
+    struct timespec sent, deadline;
+    
+    clock_gettime(CLOCK_MONOTONIC, &sent);
+    an851_decoder_init(&dec, &rx);
+    sio_deadline(&deadline, (an851_rto(s, tx) + SERIAL_GRACE_TIMEOUT) / 1000);
+    
+    while(*done < length) {
+        if((len = sio_read_until(s->fd, buf, sizeof(buf), &deadline)) <= 0) {
+            if(len == 0)
+                st->timeouts++;
+            return -1;
+        }
+        st->wire_rx += len;
+        
+        for(i = 0; i < len; i++) {
+            switch(an851_decoder_feed(&dec, buf[i])) {
+            case AN851_RX_MORE:
+                continue;
+                
+            case AN851_RX_ERROR:
+                st->bad_frames++;
+                rigel_error("corrupt response frame from device!\n");
+                return -1;
+            }
+            
+            st->raw_rx += dec.count;
+            d = rx.data;
+            n = d[0];
+            if(rx.command != RD_RANGE || rx.length != n + 4 || n == 0 ||
+               n > length - *done ||
+               ADDRESS(d[1], d[2], d[3]) != address + *done) {
+                rigel_error("Malformed read response from device!\n");
+                return -1;
+            }
+            memcpy(data + *done, d + 4, n);
+            *done += n;
+            
+            /* The first frame is timed like any other response; each
+             * one after it gets the same time again to arrive. */
+            if(first)
+                an851_rtt_sample(s, tx, an851_elapsed(&sent));
+            first = 0;
+            an851_decoder_init(&dec, &rx);
+            sio_deadline(&deadline,
+                         (an851_rto(s, tx) + SERIAL_GRACE_TIMEOUT) / 1000);
         }
-        buffer[transmit_len] = tx->data[i];
     }
     
-    /* Insert checksum */
-    if( IS_CONTROL(tx->checksum) ) {
-        buffer[transmit_len++] = DLE;
-        buffer[transmit_len++] = tx->checksum;
-    } else buffer[transmit_len++] = tx->checksum;
-    
-    /* Mark the end of the buffer with ETX (end of text) */
-    buffer[transmit_len++] = ETX;
+    return 0;
+}
 
-    if(sio_write(opts.fd, buffer, transmit_len) == -1) {
-        rigel_error("I/O error transmitting data to PIC!");
+int
+an851_rd_range(struct an851_session *s, dword address, dword length,
+               byte chunk, void *data)
+{
+    int len, retry = 0;
+    dword done = 0, at;
+    struct an851_packet tx;
+    struct an851_stats *st = &s->stats[AN851_SLOT(RD_RANGE)];
+    struct timespec first;
+    
+    if(chunk == 0 || chunk > MAX_DATA_LENGTH || length > 0xFFFFFF) {
+        rigel_error("invalid range read of %u bytes in %d byte frames!\n",
+                    length, chunk);
         return -1;
     }
     
-    /* Set timeouts for our device to wait for a response.
-     * If there is no response within this time, this generally
-     * means an error occured. */
-    switch(tx->command) {
+    s->lastcmd = RD_RANGE;
+    s->write_blocks = 0;
+    s->write_check = AN851_CHECK_NONE;
+    st->requests++;
+    clock_gettime(CLOCK_MONOTONIC, &first);
     
-    /* These commands do not have responses */
-    case PIC_RESET:
-    case IFI_RUN_CODE:
-        return 0;
+    /* Timeouts are per frame, so they scale with the frame size */
+    tx.command = RD_RANGE;
+    tx.length = 7;
+    tx.request_length = chunk;
     
-    case RD_FLASH:
-    case RD_CONFIG:
-    case RD_EEDATA:
-    case RD_VERSION:
-        sio_settimeout(opts.rlag * tx->request_length);
-        break;
-    
-    case WR_FLASH:
-    case WR_CONFIG:
-    case WR_EEDATA:
-    case IFI_WR_ROW:
-        sio_settimeout(opts.wlag * tx->request_length);
-        break;
-    
-    case ER_FLASH:
-        sio_settimeout(opts.wlag * 0xFF);
-        break;
+    for(;;) {
+        /* Ask for whatever hasn't arrived yet */
+        at = address + done;
+        tx.data[0] = chunk;
+        tx.data[1] = ADDRL(at);
+        tx.data[2] = ADDRH(at);
+        tx.data[3] = ADDRU(at);
+        tx.data[4] = (length - done) & 0xFF;
+        tx.data[5] = ((length - done) >> 8) & 0xFF;
+        tx.data[6] = ((length - done) >> 16) & 0xFF;
         
-    default:
-        break;
+        len = an851_encode(tx.command, tx.data, tx.length, s->buffer);
+        if(sio_write(s->fd, s->buffer, len) == -1) {
+            rigel_error("I/O error transmitting data to PIC!");
+            return -1;
+        }
+        st->raw_tx += tx.length + 2;
+        st->wire_tx += len;
         
-    }
+        if(an851_rx_range(s, &tx, address, length, data, &done) == 0)
+            break;
         
-    memset(rx, 0, sizeof(struct an851_packet));
-    
-    /* When we don't get a proper reponse, we retry up to 3 times.
-     * If we don't succeed on the fourth try, bail out. */
-    recv_len = an851_wait_response(buffer, sizeof(buffer));
-    if( (!recv_len || recv_len == -1) && retry < 3) {
+        /* The rest of the stream may still be on its way */
+        an851_drain(s);
+        if(s->rtt[AN851_SLOT(RD_RANGE)].backoff < AN851_MAX_BACKOFF)
+            s->rtt[AN851_SLOT(RD_RANGE)].backoff++;
+        if(retry == s->retries)
+            return -1;
         retry++;
-        goto __retry;
+        st->retries++;
     }
-        
-    if(!recv_len)
-        return -1;
-        
-    /* Strip control characters from received data */
-    for(i = 0, datalen = 0; i < recv_len; i++) {
-        if(IS_CONTROL(buffer[i])) {
-            /* Skip over the escape character and copy next data byte */
-            if(buffer[i] == DLE) {
-                i++; 
-                rx->data[datalen++] = buffer[i];
-            } else i++; /* Just skip over other control characters */
-        } else {
-            rx->data[datalen] = buffer[i];
-            datalen++;
-        }
-    }
-        
-    rx->command = rx->data[0];
-    if(tx->command != rx->command)
-        return -1;
-
-    memmove(rx->data, rx->data + 1, datalen);
+    
+    an851_time(st, an851_elapsed(&first) / 1000);
+    return retry;
+}
 
-    /* Write commands ack with only the command number, they do not
-     * send any other data. */
-    switch (rx->command) {
-    case WR_FLASH:
-    case ER_FLASH:
-    case WR_EEDATA:
-    case WR_CONFIG:
-        rx->length = 0;
-        break;
+void
+an851_get_stats(const struct an851_session *s, struct an851_stats *stats)
+{
+    memcpy(stats, s->stats, sizeof(s->stats));
+}
 
-    default: rx->length = datalen; break;
+void
+an851_add_stats(const struct an851_session *s, struct an851_stats *stats)
+{
+    int c, i;
+    const struct an851_stats *from;
+    
+    for(c = 0; c < AN851_COMMAND_SLOTS; c++) {
+        from = &s->stats[c];
+        
+        stats[c].requests   += from->requests;
+        stats[c].retries    += from->retries;
+        stats[c].timeouts   += from->timeouts;
+        stats[c].bad_frames += from->bad_frames;
+        stats[c].raw_tx     += from->raw_tx;
+        stats[c].raw_rx     += from->raw_rx;
+        stats[c].wire_tx    += from->wire_tx;
+        stats[c].wire_rx    += from->wire_rx;
+        stats[c].time       += from->time;
+        for(i = 0; i < AN851_HIST_BUCKETS; i++)
+            stats[c].hist[i] += from->hist[i];
     }
+}
 
-    /* Checksum is the last data byte in any packet */
-    rx->checksum = rx->data[rx->length];
-    if( (byte)an851_checksum(rx) != rx->checksum ) {
-        rigel_error("checksum mismatch! Expected %02X, calculated %02X\n",
-                    rx->checksum, an851_checksum(rx));
-        return -1;
+const char *
+an851_command_name(uint8_t command)
+{
+    switch(command) {
+    case RD_VERSION:   return "RD_VERSION";
+    case RD_FLASH:     return "RD_FLASH";
+    case WR_FLASH:     return "WR_FLASH";
+    case ER_FLASH:     return "ER_FLASH";
+    case RD_EEDATA:    return "RD_EEDATA";
+    case WR_EEDATA:    return "WR_EEDATA";
+    case RD_CONFIG:    return "RD_CONFIG";
+    case WR_CONFIG:    return "WR_CONFIG";
+    case IFI_RUN_CODE: return "IFI_RUN_CODE";
+    case IFI_WR_ROW:   return "IFI_WR_ROW";
+    case RD_CRC:       return "RD_CRC";
+    case SET_MODE:     return "SET_MODE";
+    case RD_RANGE:     return "RD_RANGE";
+    case PIC_RESET:    return "RESET";
+    default:           return "UNKNOWN";
     }
-
-    return retry;
 }
@@ -26,6 +26,7 @@
 #include "pic18.h"
 #include "rigel-defs.h"
 
+#include <time.h>
 #include <sys/types.h>
 
 /* Control characters */
@@ -44,12 +45,40 @@
 #define WR_CONFIG  0x07
 #define IFI_RUN_CODE 0x08
 #define IFI_WR_ROW   0x09
+#define RD_CRC       0x0A /* Extension, see AN851_CAP_CRC */
+#define SET_MODE     0x0B /* Extension, see AN851_CAP_WRSUM */
+#define RD_RANGE     0x0C /* Extension, see AN851_CAP_RANGE */
 #define PIC_RESET    0xFF /* This can really be any number */
 
+/* Extensions to the command set. A bootloader that has any of them says
+ * so in its RD_VERSION response, which then carries a byte of these flags
+ * after the two version bytes; the AN851 bootloader itself and IFI's stop
+ * at the version. */
+#define AN851_CAP_CRC   0x01 /* RD_CRC: CRC-32s of spans of flash */
+#define AN851_CAP_WRSUM 0x02 /* Write acknowledgements can carry the CRC-32
+                              * of what was actually written, once turned
+                              * on with SET_MODE (an851_set_mode) */
+#define AN851_CAP_RANGE 0x04 /* RD_RANGE: one request streams back a whole
+                              * range of flash, frame after frame */
+
+/* What the acknowledgement of the last write said about it */
+#define AN851_CHECK_NONE 0 /* Nothing; AN851_CAP_WRSUM isn't on */
+#define AN851_CHECK_OK   1 /* The data went in as it was sent */
+#define AN851_CHECK_BAD  2 /* Something else was written */
+
+/* Most CRCs an RD_CRC response holds: after the count, address and span
+ * come 4 bytes for each, and it must fit in MAX_DATA_LENGTH. */
+#define AN851_CRC_MAX ((MAX_DATA_LENGTH - 5) / 4)
+
 /* Maximum size of the AN851 Receive/Transmit Buffer */
 #define MAX_PACKET_SIZE 255
 #define MAX_DATA_LENGTH 250
 
+/* Worst case size of a framed packet of length data bytes, where every
+ * byte after the command needs escaping:
+ * <STX><STX><DLE><Command><DLE><Data>...<DLE><Checksum><ETX> */
+#define AN851_FRAME_SIZE(length) (2 * ((length) + 2) + 3)
+
 #define AN851_MINOR_VER(x) LOBYTE(x)
 #define AN851_MAJOR_VER(x) HIBYTE(x)
 
@@ -77,40 +106,204 @@ struct an851_packet {
     uint8_t checksum;
 };
 
-struct an851_config {
+/* Receive states of the frame decoder */
+#define AN851_RX_IDLE   0 /* Waiting for STX */
+#define AN851_RX_DATA   1 /* Inside a frame */
+#define AN851_RX_ESCAPE 2 /* Inside a frame, last byte was DLE */
+
+/* Return values of an851_decoder_feed */
+#define AN851_RX_ERROR -1 /* Frame was corrupt and has been dropped */
+#define AN851_RX_MORE   0 /* Need more bytes */
+#define AN851_RX_FRAME  1 /* Complete, valid frame decoded */
+
+/* Incremental decoder for received frames. Bytes are unescaped,
+ * checksummed and stored in pkt as they arrive, so a frame is complete
+ * and validated the moment its ETX is seen. */
+struct an851_decoder {
+    int state;
+    int count;     /* Unescaped bytes so far (command, data, checksum) */
+    uint8_t sum;   /* Running sum of those bytes */
+    struct an851_packet *pkt;
+};
+
+/* Times a request is retransmitted when no proper response arrives */
+#define AN851_RETRIES 3
+
+/* Round trip times and statistics are kept for each command below this
+ * value; PIC_RESET, which is really any other command, takes the last. */
+#define AN851_COMMAND_SLOTS 0x10
+#define AN851_SLOT(cmd) \
+     ((cmd) < AN851_COMMAND_SLOTS - 1 ? (cmd) : AN851_COMMAND_SLOTS - 1)
+
+/* Number of latency histogram buckets; bucket i counts requests answered
+ * in 2^i to 2^(i+1) microseconds, and the last everything slower. */
+#define AN851_HIST_BUCKETS 22
+
+/* Lower bound on a measured response timeout, in microseconds */
+#define AN851_RTO_MIN 2000
+
+/* Most times a command's timeout is doubled after timeouts */
+#define AN851_MAX_BACKOFF 4
+
+/* Response time estimate for one command. A round trip is taken to be a
+ * fixed cost (serial adapter latency, bootloader turnaround) plus a cost
+ * per unit of request_length, fitted by least squares to exponentially
+ * weighted means of the samples: of their lengths, round trip times (in
+ * nanoseconds), squared lengths and lengths times times. rttvar is how
+ * far samples stray from the fit, as a fraction of what it predicted;
+ * n is 0 until the first measurement. */
+struct an851_rtt {
+    double units, time, units2, units_time;
+    double rttvar;
+    uint32_t n;
+    int backoff;
+};
+
+/* What happened to the requests of one command over a session. Raw
+ * bytes are the command, data and checksum of each frame; wire bytes
+ * are what was actually sent or received, framed and escaped. */
+struct an851_stats {
+    uint32_t requests;
+    uint32_t retries, timeouts, bad_frames;
+    uint64_t raw_tx, raw_rx;
+    uint64_t wire_tx, wire_rx;
+    uint64_t time;  /* Microseconds from sending requests to their responses */
+    uint32_t hist[AN851_HIST_BUCKETS];
+};
+
+/* Everything associated with one connection to a bootloader. Every
+ * an851_* call operates on the session it is given, so any number of
+ * devices may be driven from one process; a single session must not
+ * be used from more than one thread at a time. */
+struct an851_session {
    int fd;
    int wlag, rlag, reset_lag;
+   int retries;
    
    struct pic18_memory_layout mem;
    
    uint8_t  max_data_length;
+   uint8_t  caps;     /* AN851_CAP_* flags, from an851_version */
+   uint8_t  mode;     /* Those turned on by an851_set_mode */
+   uint8_t  write_check; /* AN851_CHECK_* of the last request */
    uint8_t  lastcmd;
    uint32_t lastaddr;
+   
+   /* Adaptive response timeouts, seeded from wlag and rlag */
+   struct an851_rtt rtt[AN851_COMMAND_SLOTS];
+   
+   struct an851_stats stats[AN851_COMMAND_SLOTS];
+   
+   /* Outgoing frame, escaped and ready for transmission */
+   uint8_t  buffer[AN851_FRAME_SIZE(MAX_PACKET_SIZE)];
+   
+   /* The payload of the last WR_FLASH the bootloader acknowledged, which
+    * is still in its buffer for an851_replicate_write until any other
+    * command overwrites it (write_blocks is 0 once one has). */
+   uint8_t  write_blocks;
+   uint8_t  write_data[MAX_DATA_LENGTH];
 }; 
 
 /* AN851 Bootloader Protocol [AN851, Appendix A] */
-int an851_safe_init(int fd);
-int an851_init(int fd, int wlag, int rlag, struct pic18_memory_layout mmap);
-int an851_wait_response(uint8_t *buf, size_t max);
+struct an851_session *an851_session_new(int fd);
+void an851_session_free(struct an851_session *s);
+
+int an851_init(struct an851_session *s, int wlag, int rlag,
+               struct pic18_memory_layout mmap);
+int an851_wait_response(struct an851_session *s, struct an851_packet *rx,
+                        uint8_t ack, const uint8_t *echo, int echolen,
+                        const struct timespec *deadline);
+
+/* Throw away whatever the device is still sending, until the line has
+ * been quiet for the grace period. */
+void an851_drain(struct an851_session *s);
+
+/* Copy the statistics of every command so far (AN851_COMMAND_SLOTS of
+ * them, indexed by AN851_SLOT) into stats, or add them to it. */
+void an851_get_stats(const struct an851_session *s,
+                     struct an851_stats *stats);
+void an851_add_stats(const struct an851_session *s,
+                     struct an851_stats *stats);
+
+/* Name of a command, for reports */
+const char *an851_command_name(uint8_t command);
+
+/* AN851 framing, shared with the an851d simulator */
+int  an851_encode(uint8_t command, const uint8_t *data, int length,
+                  uint8_t *out);
+void an851_decoder_init(struct an851_decoder *dec, struct an851_packet *pkt);
+int  an851_decoder_feed(struct an851_decoder *dec, uint8_t c);
+
+int an851_reset  (struct an851_session *s);
+int an851_version(struct an851_session *s);
+int ifi_run_program(struct an851_session *s);
+int ifi_wr_row(struct an851_session *s,
+               uint32_t address, uint8_t rows, uint8_t val);
+
+int an851_rd(struct an851_session *s,
+             uint8_t command, uint32_t address, uint8_t length, void *rx);
+
+int an851_rd_flash (struct an851_session *s,
+                    uint32_t address, uint8_t length, void *flashdata);
+int an851_rd_eeprom(struct an851_session *s,
+                    uint16_t address, uint8_t length, void *eedata);
+int an851_rd_config(struct an851_session *s,
+                    uint32_t address, uint8_t length, void *configdata);
+
+/* Read length bytes of flash at address into data with one RD_RANGE
+ * request, which the bootloader answers with one frame of up to chunk
+ * bytes after another, like RD_FLASH responses, until it has sent them
+ * all. If the stream breaks off, the rest is asked for again. Returns the
+ * number of retries, or -1. Only for bootloaders with AN851_CAP_RANGE. */
+int an851_rd_range(struct an851_session *s, uint32_t address,
+                   uint32_t length, uint8_t chunk, void *data);
+
+/* Read the CRC-32s (as rimage_crc computes them) of count consecutive
+ * spans of flash starting at address, each span blocks blocks long, into
+ * crcs. count may be up to AN851_CRC_MAX. Only for bootloaders with
+ * AN851_CAP_CRC. */
+int an851_rd_crc(struct an851_session *s, uint32_t address, uint8_t blocks,
+                 uint8_t count, uint32_t *crcs);
+
+/* Switch on the bootloader modes in flags (AN851_CAP_WRSUM), which
+ * last until it is reset. Returns the flags it took, or -1. */
+int an851_set_mode(struct an851_session *s, uint8_t flags);
 
-int an851_reset  (void);
-int an851_version(void);
-int ifi_run_program(void);
-int ifi_wr_row(uint32_t address, uint8_t rows, uint8_t val);
+/* Writes and erases return the number of times the request had to be
+ * retransmitted, or -1 on failure. With AN851_CAP_WRSUM on, flash and
+ * EEPROM writes leave what the acknowledgement said in write_check. */
+int an851_wr_flash (struct an851_session *s,
+                    uint32_t address, uint8_t blocks, void *data);
+int an851_wr_eeprom(struct an851_session *s,
+                    uint16_t address, uint8_t length, void *data);
+int an851_wr_config(struct an851_session *s,
+                    uint8_t confaddr, uint8_t length, void *data);
 
-int an851_rd(uint8_t command, uint32_t address, uint8_t length, void *rx);
+int an851_er_flash(struct an851_session *s, uint32_t address, uint8_t rows);
 
-int an851_rd_flash (uint32_t address, uint8_t length, void *flashdata);
-int an851_rd_eeprom(uint16_t address, uint8_t length, void *eedata);
-int an851_rd_config(uint32_t address, uint8_t length, void *configdata);
+/* Send a request that has already been framed (by an851_encode) and
+ * wait for an acknowledgement carrying the command ack, retrying as the
+ * write functions above do. tx describes the request: only its command,
+ * length (of the data in the frame) and request_length are used. For a
+ * WR_FLASH, crc is the CRC-32 of the data it writes, and write_check
+ * says whether the acknowledgement agreed. */
+int an851_tx_frame(struct an851_session *s, const struct an851_packet *tx,
+                   const uint8_t *frame, int length, uint8_t ack,
+                   uint32_t crc);
 
-int an851_wr_flash (uint32_t address, uint8_t blocks, void *data);
-int an851_wr_eeprom(uint16_t address, uint8_t length, void *data);
-int an851_wr_config(uint8_t confaddr, uint8_t length, void *data);
+int an851_repeat(struct an851_session *s);
 
-int an851_er_flash(uint32_t address, uint8_t rows);
+/* Replicate: send just the command, length and address of a write, so
+ * that the bootloader writes the data left in its buffer by the last one
+ * at address. Only valid straight after another write of the same length
+ * (see an851_can_replicate). */
+int an851_replicate_write(struct an851_session *s, uint8_t write_command,
+                          uint8_t length, uint32_t address);
 
-int an851_repeat(void);
-int an851_replicate_write(uint8_t write_command, uint8_t length, uint32_t address);
+/* Whether writing blocks blocks of data to flash can be done with
+ * an851_replicate_write, because the last request was a WR_FLASH of the
+ * very same data. */
+int an851_can_replicate(const struct an851_session *s, uint8_t blocks,
+                        const void *data);
 
 #endif /* _AN851_H */
@@ -0,0 +1,248 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME  0x00000100000001B3ULL
+
+/* The cache is local to this machine, so everything is stored in native
+ * byte order; the header is followed by nsegs segment headers, each
+ * followed by its data. */
+struct cache_header {
+    char     magic[4];
+    uint32_t version;
+    uint64_t hash;          /* Hash (cache_hash) of the source file */
+    uint64_t size;          /* Size of the source file */
+    int64_t  mtime;         /* Modification time of the source file */
+    uint32_t format;
+    uint32_t nsegs;
+    uint8_t  fill;
+    uint8_t  reserved[7];
+};
+
+struct cache_segment {
+    uint32_t address, length;
+};
+
+struct cache_key {
+    char path[PATH_MAX];    /* Of the cache file */
+    struct cache_header header;
+};
+
+/* FNV-1a, taken a word at a time rather than a byte at a time: hashing
+ * the source file must cost much less than parsing it for the cache to
+ * be worth having. */
+static uint64_t
+cache_hash(uint64_t hash, const void *udata, size_t length)
+{
+    const uint8_t *data = (const uint8_t *)udata;
+    uint64_t word;
+
+    for(; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+        memcpy(&word, data, sizeof(uint64_t));
+        data += sizeof(uint64_t);
+        hash ^= word;
+        hash *= FNV_PRIME;
+    }
+    while(length--) {
+        hash ^= *data++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Work out where fn would be cached and what its entry must record.
+ * Returns -1 if it can't be cached at all. */
+static int
+cache_key(const char *fn, int format, struct cache_key *key)
+{
+    int fd;
+    void *data;
+    struct stat st;
+    char real[PATH_MAX];
+    const char *base = getenv("XDG_CACHE_HOME"), *sub = CACHE_DIR;
+    uint64_t name;
+
+    if(getenv("RIGEL_NO_CACHE") || !realpath(fn, real))
+        return -1;
+    if(!base || !*base) {
+        if(!(base = getenv("HOME")))
+            return -1;
+        sub = ".cache/" CACHE_DIR;
+    }
+
+    if((fd = open(real, O_RDONLY)) == -1)
+        return -1;
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+       (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                    0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    memset(&key->header, 0, sizeof(struct cache_header));
+    memcpy(key->header.magic, CACHE_MAGIC, 4);
+    key->header.version = CACHE_VERSION;
+    key->header.hash    = cache_hash(FNV_OFFSET, data, st.st_size);
+    key->header.size    = st.st_size;
+    key->header.mtime   = st.st_mtime;
+    key->header.format  = format;
+    munmap(data, st.st_size);
+
+    name = cache_hash(FNV_OFFSET, real, strlen(real));
+    name = cache_hash(name, &key->header.format, sizeof(uint32_t));
+    snprintf(key->path, sizeof(key->path), "%s/%s/%016llx", base, sub,
+             (unsigned long long)name);
+
+    return 0;
+}
+
+/* Map the cache entry for key into a new image, or return NULL if there
+ * is no current one. */
+static struct image *
+cache_load(const struct cache_key *key)
+{
+    int fd;
+    struct stat st;
+    const uint8_t *map, *p, *end;
+    const struct cache_header *header;
+    struct cache_segment seg;
+    struct image *img = NULL;
+    uint32_t i;
+
+    if((fd = open(key->path, O_RDONLY)) == -1)
+        return NULL;
+    if(fstat(fd, &st) == -1 ||
+       (size_t)st.st_size < sizeof(struct cache_header) ||
+       (map = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ,
+                                    MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    /* Everything up to the segment count must match what the source
+     * file says now. */
+    header = (const struct cache_header *)map;
+    if(memcmp(header, &key->header,
+              offsetof(struct cache_header, nsegs)) != 0 ||
+       !(img = image_alloc(header->fill)))
+        goto out;
+
+    p   = map + sizeof(struct cache_header);
+    end = map + st.st_size;
+    for(i = 0; i < header->nsegs; i++) {
+        if(end - p < (ptrdiff_t)sizeof(struct cache_segment))
+            goto bad;
+        memcpy(&seg, p, sizeof(struct cache_segment));
+        p += sizeof(struct cache_segment);
+
+        if((uint32_t)(end - p) < seg.length ||
+           image_put(img, seg.address, p, seg.length) == -1)
+            goto bad;
+        p += seg.length;
+    }
+    if(p == end)
+        goto out;
+
+bad:
+    image_free(img);
+    img = NULL;
+out:
+    munmap((void *)map, st.st_size);
+    return img;
+}
+
+/* Create the directories leading up to path */
+static void
+cache_mkdirs(const char *path)
+{
+    char dir[PATH_MAX], *p;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for(p = dir + 1; (p = strchr(p, '/')); p++) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+}
+
+/* Store img as the cache entry for key. Failing to is not an error; the
+ * file just gets parsed again next time. The entry is written under a
+ * temporary name and renamed into place, so that a concurrent reader
+ * never sees half of it. */
+static void
+cache_store(struct cache_key *key, const struct image *img)
+{
+    FILE *fp;
+    char tmp[PATH_MAX + 16];
+    struct cache_segment seg;
+    uint32_t i;
+    int ok;
+
+    cache_mkdirs(key->path);
+    snprintf(tmp, sizeof(tmp), "%s.%ld", key->path, (long)getpid());
+    if(!(fp = fopen(tmp, "wb")))
+        return;
+
+    key->header.nsegs = img->nsegs;
+    key->header.fill  = img->fill;
+    ok = fwrite(&key->header, sizeof(struct cache_header), 1, fp) == 1;
+    for(i = 0; ok && i < img->nsegs; i++) {
+        seg.address = img->segs[i].address;
+        seg.length  = img->segs[i].length;
+        ok = fwrite(&seg, sizeof(struct cache_segment), 1, fp) == 1 &&
+             fwrite(img->segs[i].data, 1, seg.length, fp) == seg.length;
+    }
+
+    if(fclose(fp) != 0 || !ok || rename(tmp, key->path) == -1)
+        unlink(tmp);
+}
+
+struct image *
+cache_read(const char *fn, int format, FormatReadFunc reader)
+{
+    struct cache_key key;
+    struct image *img;
+    int cached = (cache_key(fn, format, &key) == 0);
+
+    if(cached && (img = cache_load(&key)))
+        return img;
+
+    if(!(img = image_alloc(0xFF)))
+        return NULL;
+    if(reader(fn, img) == -1) {
+        image_free(img);
+        return NULL;
+    }
+
+    if(cached)
+        cache_store(&key, img);
+    return img;
+}
@@ -0,0 +1,46 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/* librigel API for caching parsed program images on disk, so that loading
+ * the same file again maps the cached image instead of parsing it. */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "image.h"
+#include "inhex32.h"
+
+/* Cached images live in $XDG_CACHE_HOME/rigel (or ~/.cache/rigel), one
+ * file per source file, named after its path and format. Each records
+ * the source's modification time, size and content hash, and is only
+ * used while all three still match. Setting RIGEL_NO_CACHE in the
+ * environment turns the cache off. */
+#define CACHE_DIR   "rigel"
+#define CACHE_MAGIC "RGIC"
+
+/* Bump whenever the layout (or what the readers put in an image)
+ * changes, so that stale entries are parsed again. */
+#define CACHE_VERSION 1
+
+/* Read fn into a new image, from the cache if it holds a current copy
+ * and otherwise with reader (storing the result for next time). format
+ * is part of the key, since the same file reads differently as different
+ * formats. Returns the image, to be freed with image_free, or NULL if
+ * reader fails. */
+struct image *cache_read(const char *fn, int format, FormatReadFunc reader);
+
+#endif /* _CACHE_H */
@@ -19,12 +19,15 @@
 
 #include "an851.h"
 #include "serialio.h"
+#include "planner.h"
+#include "rimage.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 static int device_is_ifi(const struct device *dev);
+static void device_probe_reads(struct device *dev);
 
 int
 device_connect_only(const char *tty, struct device *dev)
@@ -41,25 +44,30 @@ device_connect(const char *tty, struct device *dev,
                struct device **list, int numdev)
 {
     int i, fd, bver, found;
+    struct an851_session *session;
     found = 0;
     
     if((fd = device_connect_only(tty, dev)) == -1)
         return -1;
     
-    /* We perform a "safe" initialization of the AN851
+    /* We start with a "safe" session on the AN851
      * interface (very generous read/write times) so we
      * can write a short identification command and then
      * do a proper configuration optimized for our device. */
-    an851_safe_init(fd);
+    if(!(session = an851_session_new(fd))) {
+        sio_close(fd);
+        return -1;
+    }
+    dev->session = session;
     
-    if( (bver = an851_version()) == -1 ) {
+    if( (bver = an851_version(session)) == -1 ) {
         rigel_error("Is your device connected to %s and in program mode?\n", tty);
-        return -1;
+        goto error;
     }
                    
     if(device_get_id(dev) == -1) {
         rigel_error("reading device ID\n");
-        return -1;
+        goto error;
     }
     
     for(i = 0; i < numdev; i++)
@@ -70,23 +78,24 @@ device_connect(const char *tty, struct device *dev,
         }
     dev->bootver = (uint16_t)bver;
     dev->opts.fd = fd;
+    dev->session = session;
     dev->state.connected = 0;
     
     if(!found) {
         rigel_error("unknown device! DEVID registers: %04X\n", dev->dev_id);
-        return -1;
+        goto error;
     }
     
-    an851_init(dev->opts.fd, dev->opts.wlag, dev->opts.rlag, dev->mem);
+    an851_init(session, dev->opts.wlag, dev->opts.rlag, dev->mem);
     
     if((dev->is_ifi = device_is_ifi(dev)) == -1)
-        return -1;
+        goto error;
         
-    if(an851_rd_config(dev->mem.config_low, 
+    if(an851_rd_config(session, dev->mem.config_low, 
                        sizeof(struct pic18_config_registers),
                        &dev->config) == -1) {
         rigel_error("Could not read configuration registers!\n");
-        return -1;
+        goto error;
     }
     
     /* The BBSIZ bits of the CONFIG4L register describe the
@@ -98,8 +107,60 @@ device_connect(const char *tty, struct device *dev,
         else dev->mem.flash_low = 0x2000; /* BBSIZ = 10b/11b, 8KB */
     }   else dev->mem.flash_low = 0x0800; /* BBSIZ = 00b, 2KB */
 
+    /* Writes start out at the configured size and are tuned as we go;
+     * reads can be tried out straight away. */
+    dev->opts.write_packet_size = min(DEVICE_MAX_WRITE,
+                                      dev->opts.max_packet_size -
+                                      dev->opts.max_packet_size %
+                                      BYTES_PER_BLOCK);
+    dev->state.clean_writes = 0;
+    dev->opts.replicate = 1;
+    device_probe_reads(dev);
+    
+    /* Have writes checked by the bootloader itself if it can */
+    if((session->caps & AN851_CAP_WRSUM) &&
+       an851_set_mode(session, AN851_CAP_WRSUM) == -1)
+        rigel_warn("bootloader wouldn't check its writes; "
+                   "carrying on without.\n");
+
     dev->state.connected = 1;
     return dev->dev_id;
+    
+error:
+    an851_session_free(session);
+    dev->session = NULL;
+    sio_close(fd);
+    
+    return -1;
+}
+
+/* Find the largest read the bootloader answers cleanly, trying sizes
+ * from MAX_DATA_LENGTH down to the configured packet size, which is
+ * taken to work. A size is only tried once, so that a bootloader that
+ * can't cope with it costs us a single timeout. */
+static void
+device_probe_reads(struct device *dev)
+{
+    static const uint8_t sizes[] = { MAX_DATA_LENGTH, 3 * BYTES_PER_ROW };
+    int i, retries = dev->session->retries;
+    
+    dev->opts.read_packet_size = dev->opts.max_packet_size;
+    dev->session->retries = 0;
+    
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if(sizes[i] <= dev->opts.max_packet_size)
+            break;
+        if(an851_rd_flash(dev->session, dev->mem.flash_low, sizes[i],
+                          dev->buffer) != -1) {
+            dev->opts.read_packet_size = sizes[i];
+            break;
+        }
+        
+        /* A slow answer must not be read as the next request's */
+        an851_drain(dev->session);
+    }
+    
+    dev->session->retries = retries;
 }
 
 /* If we do not get a response from the device with a IFI_WR_ROW
@@ -113,11 +174,12 @@ device_is_ifi(const struct device *dev)
     /* Save first row of data and attempt to use the IFI_WR_ROW
      * command - if it works, we have an IFI device, and we must
      * re-write that data back. */
-    if(an851_rd_flash(dev->mem.flash_low, BYTES_PER_ROW, temp) == -1)
+    if(an851_rd_flash(dev->session, dev->mem.flash_low,
+                      BYTES_PER_ROW, temp) == -1)
         return -1;
     
-    if(ifi_wr_row(dev->mem.flash_low, 1, 0x00) == 0) {
-        an851_wr_flash(dev->mem.flash_low,
+    if(ifi_wr_row(dev->session, dev->mem.flash_low, 1, 0x00) != -1) {
+        an851_wr_flash(dev->session, dev->mem.flash_low,
                        BYTES_PER_ROW / BYTES_PER_BLOCK, temp);
         return 1;
     }
@@ -128,8 +190,12 @@ device_is_ifi(const struct device *dev)
 int
 device_disconnect(struct device *dev)
 {
-    if(dev->state.connected)
+    if(dev->state.connected) {
+        device_get_stats(dev, NULL);
+        an851_session_free(dev->session);
         sio_close(dev->opts.fd);
+    }
+    dev->session = NULL;
     dev->state.connected = 0;
 
     if(dev->state.refcount_allocs != 0)
@@ -139,6 +205,27 @@ device_disconnect(struct device *dev)
     return 0;
 }
 
+void
+device_get_stats(struct device *dev, struct an851_stats *stats)
+{
+    int c, b;
+    struct an851_stats all[AN851_COMMAND_SLOTS];
+    
+    if(!dev->session)
+        return;
+    
+    an851_get_stats(dev->session, all);
+    if(stats)
+        memcpy(stats, all, sizeof(all));
+    
+    dev->state.tx_count = dev->state.rx_count = 0;
+    for(c = 0; c < AN851_COMMAND_SLOTS; c++) {
+        dev->state.tx_count += all[c].requests + all[c].retries;
+        for(b = 0; b < AN851_HIST_BUCKETS; b++)
+            dev->state.rx_count += all[c].hist[b];
+    }
+}
+
 void
 device_run_program(const struct device *dev)
 {
@@ -148,13 +235,13 @@ device_run_program(const struct device *dev)
         return;
     
     if(dev->is_ifi)
-        ifi_run_program();
+        ifi_run_program(dev->session);
     else {
         /* For non-IFI devices using the AN851 bootloader, to
          * leave boot mode you must write a non-0xFF value to
          * the last byte in data EEPROM. */
-        an851_wr_eeprom(dev->mem.eeprom_high, 1, &run);
-        an851_reset(); /* Is this necessary? */
+        an851_wr_eeprom(dev->session, dev->mem.eeprom_high, 1, &run);
+        an851_reset(dev->session); /* Is this necessary? */
     }
 }
 
@@ -162,7 +249,7 @@ void
 device_reset(const struct device *dev)
 {
     if(dev->state.connected)
-        an851_reset();
+        an851_reset(dev->session);
 }
 
 void
@@ -178,17 +265,26 @@ device_get_id(struct device *dev)
 {
     uint8_t devid[2];
 
-    if(an851_rd(RD_FLASH, 0x3FFFFE, 2, devid) == -1)
+    if(an851_rd(dev->session, RD_FLASH, 0x3FFFFE, 2, devid) == -1)
         return -1;
         
     dev->dev_id = MAKEWORD(devid[0], devid[1]);
     return (long)dev->dev_id;
 }
 
+/* Erase up to PLAN_MAX_ERASE rows starting at address in one request. */
+static int
+device_erase_rows(const struct device *dev, uint32_t address, uint8_t rows)
+{
+    if(dev->is_ifi)
+        return ifi_wr_row(dev->session, address, rows, 0x00);
+    return an851_er_flash(dev->session, address, rows);
+}
+
 int
 device_erase_flash(const struct device *dev, uint32_t address, uint16_t rows)
 {
-    uint8_t max = 0xFF; /* We can erase up to 255 rows at a time */
+    uint8_t max = PLAN_MAX_ERASE; /* We can erase up to 255 rows at a time */
     uint32_t erased;
 
     if(!dev->state.connected)
@@ -209,13 +305,9 @@ device_erase_flash(const struct device *dev, uint32_t address, uint16_t rows)
         if(rows - erased < max)
             max = rows - erased;
         
-        if(dev->is_ifi) {
-            if(ifi_wr_row(address + (erased * BYTES_PER_ROW), max, 0x00) == -1)
-                return -1;
-        } else {
-            if(an851_er_flash(address + (erased * BYTES_PER_ROW), max) == -1)
-                return -1;
-        }
+        if(device_erase_rows(dev, address + (erased * BYTES_PER_ROW),
+                             max) == -1)
+            return -1;
         
         if(dev->update_func)
             dev->update_func(erased, rows);        
@@ -226,13 +318,66 @@ device_erase_flash(const struct device *dev, uint32_t address, uint16_t rows)
     return 0;
 }
 
+/* Pick the writes DEVICE_VERIFY_SAMPLE reads back: every one that had
+ * to be retried (or never got an acknowledgement), and verify_percent
+ * percent of the rest, at random. */
+static int
+device_sample(struct device *dev, int retries)
+{
+    dev->state.sample = dev->state.sample * 1103515245 + 12345;
+    
+    return retries != 0 ||
+           (dev->state.sample >> 16) % 100 < dev->opts.verify_percent;
+}
+
+/* A sampled write came back wrong, so none of the writes that weren't
+ * sampled can be trusted either. */
+static void
+device_escalate(struct device *dev, const char *what, uint32_t address)
+{
+    rigel_warn("%s write at %06Xh did not verify (sample seed %u); "
+               "verifying everything.\n", what, address,
+               dev->opts.verify_seed);
+    dev->state.verify_all = 1;
+}
+
+int
+device_check_write(struct device *dev, int retries)
+{
+    if(dev->opts.verify_on_write != DEVICE_VERIFY_SAMPLE)
+        return dev->opts.verify_on_write != DEVICE_VERIFY_NONE;
+    
+    return dev->state.verify_all || device_sample(dev, retries);
+}
+
+/* Whether a flash load is to be read back in full once it is written;
+ * not if every write was confirmed as it went (see AN851_CAP_WRSUM). */
+static int
+device_verify_all(const struct device *dev)
+{
+    return dev->state.unchecked &&
+           (dev->opts.verify_on_write == DEVICE_VERIFY_AFTER ||
+            (dev->opts.verify_on_write == DEVICE_VERIFY_SAMPLE &&
+             dev->state.verify_all));
+}
+
+void
+device_set_sampling(struct device *dev, uint8_t percent, uint32_t seed)
+{
+    dev->opts.verify_on_write = DEVICE_VERIFY_SAMPLE;
+    dev->opts.verify_percent  = percent;
+    dev->opts.verify_seed     = seed;
+    dev->state.sample     = seed;
+    dev->state.verify_all = 0;
+}
+
 int
 device_write_eeprom(struct device *dev, uint32_t address,
                     uint16_t length, void *udata)
 {
-    int c;
+    int c, retries;
     uint8_t *data = (uint8_t*)udata;
-    uint8_t max = dev->opts.max_packet_size;
+    uint8_t max;
 
     if(!dev->state.connected)
         return -1;
@@ -242,20 +387,35 @@ device_write_eeprom(struct device *dev, uint32_t address,
         return -1;
     }
             
+    /* EEPROM is rewritten byte by byte, with no erase, so when a sampled
+     * write turns out wrong the whole of it is simply written again with
+     * every write checked. */
+restart:
+    max = dev->opts.max_packet_size;
     for(c = 0; c < length; c += max) {
         /* If there isn't enough data left to fill the maximum
          * buffer, adjust the final amount of data to be written
          * to prevent overflow */
         if((length - c) < max)
             max = (length - c);
-        an851_wr_eeprom(address+c, max, &data[c]);
+        retries = an851_wr_eeprom(dev->session, address+c, max, &data[c]);
         
         if(dev->update_func)
             dev->update_func(c, length);
         
-        if(dev->opts.verify_on_write) {
-            if( an851_rd_eeprom(address+c, max, dev->buffer) == -1 ||
+        if(dev->session->write_check == AN851_CHECK_OK)
+            continue;
+        if(dev->session->write_check == AN851_CHECK_BAD ||
+           device_check_write(dev, retries)) {
+            if( dev->session->write_check == AN851_CHECK_BAD ||
+                an851_rd_eeprom(dev->session, address+c, max,
+                                dev->buffer) == -1 ||
                 memcmp(&data[c], dev->buffer, max) != 0 ) {
+                if(dev->opts.verify_on_write == DEVICE_VERIFY_SAMPLE &&
+                   !dev->state.verify_all) {
+                    device_escalate(dev, "EEPROM", address+c);
+                    goto restart;
+                }
                 rigel_error("Error verifying EEPROM write, "
                       "address %04Xh!\n", address+c);
                 return -1;
@@ -273,7 +433,7 @@ device_read_eeprom(const struct device *dev, uint32_t address,
                    uint16_t length, void *data)
 {
     uint16_t c;
-    uint8_t max = dev->opts.max_packet_size;
+    uint8_t max = dev->opts.read_packet_size;
 
     if(!dev->state.connected)
         return -1;
@@ -287,7 +447,7 @@ device_read_eeprom(const struct device *dev, uint32_t address,
         if((length - c) < max)
             max = (length - c);
         
-        if( an851_rd_eeprom(address+c, max, data+c) == -1 ) {
+        if( an851_rd_eeprom(dev->session, address+c, max, data+c) == -1 ) {
             rigel_error("Could not read EEPROM data from %08X-%08X.\n", address+c, address+c+max);
             return -1;
         }
@@ -301,11 +461,21 @@ device_read_eeprom(const struct device *dev, uint32_t address,
     return 0;
 }
 
+int
+device_read_range(const struct device *dev, uint32_t address,
+                  uint32_t length, void *data)
+{
+    if(dev->session->caps & AN851_CAP_RANGE)
+        return an851_rd_range(dev->session, address, length,
+                              dev->opts.read_packet_size, data);
+    
+    return an851_rd_flash(dev->session, address, length, data);
+}
+
 int
 device_read_flash(const struct device *dev, uint32_t address, uint32_t length, void *buffer)
 {
-    uint32_t cur = 0;
-    uint8_t max = dev->opts.max_packet_size;
+    uint32_t cur = 0, max = DEVICE_READ_SIZE(dev);
 
     if(!dev->state.connected)
         return -1;
@@ -319,7 +489,7 @@ device_read_flash(const struct device *dev, uint32_t address, uint32_t length, v
         if((length - cur) < max)
             max = (length - cur);
             
-        if( an851_rd_flash(address+cur, max, buffer+cur) == -1 ) {
+        if( device_read_range(dev, address+cur, max, buffer+cur) == -1 ) {
             rigel_error("reading flash memory\n");
             return -1;
         }
@@ -331,19 +501,253 @@ device_read_flash(const struct device *dev, uint32_t address, uint32_t length, v
     return 0;
 }
 
+/* Whether the nbytes (whole blocks) of flash at address hold expect;
+ * checked by CRC if the bootloader can, instead of reading them back. */
+static int
+device_flash_matches(struct device *dev, uint32_t address, uint32_t nbytes,
+                     const uint8_t *expect)
+{
+    uint32_t crc;
+    
+    if(dev->session->caps & AN851_CAP_CRC)
+        return an851_rd_crc(dev->session, address, nbytes / BYTES_PER_BLOCK,
+                            1, &crc) != -1 &&
+               crc == rimage_crc(0, expect, nbytes);
+    
+    return an851_rd_flash(dev->session, address, nbytes,
+                          dev->buffer) != -1 &&
+           memcmp(expect, dev->buffer, nbytes) == 0;
+}
+
+/* Write one packet of blocks from memory (indexed by address). Returns
+ * the number of retries it took, or -1 if it was never acknowledged. */
+static int
+device_write_blocks(struct device *dev, uint32_t address, uint8_t blocks,
+                    const uint8_t *memory)
+{
+    int retries;
+    uint32_t nbytes = blocks * BYTES_PER_BLOCK;
+    
+    /* Blocks just like the ones last written (padding, tables) needn't
+     * be sent again; the bootloader still has them. One that doesn't
+     * answer replicate writes may not implement them, so the data is
+     * sent after all, and with every write from then on. */
+    if(dev->opts.replicate &&
+       an851_can_replicate(dev->session, blocks, &memory[address])) {
+        if((retries = an851_replicate_write(dev->session, WR_FLASH, blocks,
+                                            address)) != -1)
+            return retries;
+        
+        rigel_warn("replicate write at %06Xh went unanswered; sending the "
+                   "data of every write instead.\n", address);
+        dev->opts.replicate = 0;
+        an851_drain(dev->session);
+    }
+    
+    /* Utilize the device "scratch" buffer to enforce 8-byte
+     * alignment. The most data allowed to be written at any time is
+     * 250 bytes, so by using dev->buffer, it's alway aligned. */
+    memset(dev->buffer, 0xFF, DEVICE_BUFFER_SIZE);
+    memcpy(dev->buffer, &memory[address], nbytes);
+    retries = an851_wr_flash(dev->session, address, blocks, dev->buffer);
+    if(retries == -1)
+        rigel_error("writing flash memory\n");
+    
+    return retries;
+}
+
+/* Check the packet device_write_blocks just wrote, as verify_on_write
+ * says. Returns -1 if it went in wrong and there is no full pass at the
+ * end to put it right. */
+static int
+device_check_blocks(struct device *dev, uint32_t address, uint8_t blocks,
+                    const uint8_t *memory, int retries)
+{
+    uint32_t nbytes = blocks * BYTES_PER_BLOCK;
+    
+    /* A bootloader that checks its own writes has already said whether
+     * this one went in right. Otherwise, if user wants to verify what has
+     * been written (very good idea!) read the block(s) we just wrote and
+     * compare it to what is in the HEX file */
+    if(dev->session->write_check == AN851_CHECK_OK)
+        return 0;
+    if(dev->session->write_check == AN851_CHECK_NONE &&
+       !(dev->opts.verify_on_write == DEVICE_VERIFY_EACH ||
+         (dev->opts.verify_on_write == DEVICE_VERIFY_SAMPLE &&
+          !dev->state.verify_all && device_sample(dev, retries)))) {
+        dev->state.unchecked++;
+        return 0;
+    }
+    
+    if(dev->session->write_check == AN851_CHECK_BAD ||
+       !device_flash_matches(dev, address, nbytes, &memory[address])) {
+        /* Writes that go wrong are put right by the full pass at the end
+         * when there is one */
+        dev->state.unchecked++;
+        if(dev->opts.verify_on_write == DEVICE_VERIFY_SAMPLE)
+            device_escalate(dev, "flash", address);
+        else if(dev->opts.verify_on_write != DEVICE_VERIFY_AFTER) {
+            rigel_error("verifying flash write, address %06Xh!\n", address);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Write the next packet of up to avail blocks starting at address, at
+ * the current write size. The write size grows by a row after every
+ * DEVICE_RAMP_WRITES clean writes, up to DEVICE_MAX_WRITE, is halved when
+ * a write needs retrying, and falls back to max_packet_size (retrying the
+ * packet there) when one goes unacknowledged. A write that went in wrong
+ * isn't retried, since flash can't be written over without erasing it.
+ * Returns the number of blocks written, or -1. */
+static int
+device_write_packet(struct device *dev, uint32_t address, uint32_t avail,
+                    const uint8_t *memory)
+{
+    int retries;
+    uint32_t blocks, end;
+    uint8_t base = min(DEVICE_MAX_WRITE, dev->opts.max_packet_size -
+                       dev->opts.max_packet_size % BYTES_PER_BLOCK);
+    
+    for(;;) {
+        blocks = min(avail, dev->opts.write_packet_size / BYTES_PER_BLOCK);
+        
+        /* Stop short at a row boundary if there is more to come, so that
+         * the following packets are written in whole rows. */
+        end = address + blocks * BYTES_PER_BLOCK;
+        if(blocks < avail && end % BYTES_PER_ROW &&
+           end - end % BYTES_PER_ROW > address)
+            blocks -= (end % BYTES_PER_ROW) / BYTES_PER_BLOCK;
+        
+        if((retries = device_write_blocks(dev, address, blocks,
+                                          memory)) != -1)
+            break;
+        
+        if(dev->opts.write_packet_size <= base)
+            return -1;
+        dev->opts.write_packet_size = base;
+        dev->state.clean_writes = 0;
+    }
+    
+    if(device_check_blocks(dev, address, blocks, memory, retries) == -1)
+        return -1;
+    
+    if(retries > 0) {
+        dev->opts.write_packet_size =
+            max(base, (dev->opts.write_packet_size / 2) -
+                       (dev->opts.write_packet_size / 2) % BYTES_PER_BLOCK);
+        dev->state.clean_writes = 0;
+    } else if(++dev->state.clean_writes >= DEVICE_RAMP_WRITES) {
+        dev->opts.write_packet_size = min(DEVICE_MAX_WRITE,
+                                          dev->opts.write_packet_size +
+                                          BYTES_PER_ROW);
+        dev->state.clean_writes = 0;
+    }
+    
+    return blocks;
+}
+
+/* Read back length bytes of flash at address in reads as large as the
+ * bootloader takes, and mark the rows where they differ from expect in
+ * bad (indexed by row number, as for device_diff_flash). Returns the
+ * number of rows newly marked, or -1. */
+static int
+device_readback_range(const struct device *dev, uint32_t address,
+                      uint32_t length, const uint8_t *expect, uint8_t *bad)
+{
+    uint8_t buffer[DEVICE_BUFFER_SIZE];
+    uint32_t c, len, done, row;
+    int marked = 0;
+    
+    for(done = 0; done < length; done += len) {
+        len = min(dev->opts.read_packet_size, length - done);
+        if(an851_rd_flash(dev->session, address + done, len,
+                          buffer) == -1) {
+            rigel_error("reading flash memory\n");
+            return -1;
+        }
+        
+        for(c = 0; c < len; c++) {
+            row = (address + done + c) / BYTES_PER_ROW;
+            if(buffer[c] != expect[done + c] && !bad[row]) {
+                bad[row] = 1;
+                marked++;
+            }
+        }
+    }
+    
+    return marked;
+}
+
+/* Check the flash at address against expect the way device_readback_range
+ * does, but with the CRCs of DEVICE_CRC_SPAN byte spans computed by the
+ * bootloader (RD_CRC), so that only the spans that differ are read back. */
+static int
+device_crc_range(const struct device *dev, uint32_t address,
+                 uint32_t length, const uint8_t *expect, uint8_t *bad)
+{
+    uint32_t crcs[AN851_CRC_MAX];
+    uint32_t done, span, count, i, at;
+    int n, marked = 0;
+    
+    for(done = 0; length - done >= BYTES_PER_BLOCK; done += count * span) {
+        span  = min(DEVICE_CRC_SPAN, (length - done) -
+                                     (length - done) % BYTES_PER_BLOCK);
+        count = min(AN851_CRC_MAX, (length - done) / span);
+        if(an851_rd_crc(dev->session, address + done,
+                        span / BYTES_PER_BLOCK, count, crcs) == -1) {
+            rigel_error("reading flash CRCs\n");
+            return -1;
+        }
+        
+        for(i = 0; i < count; i++) {
+            at = done + i * span;
+            if(crcs[i] == rimage_crc(0, expect + at, span))
+                continue;
+            if((n = device_readback_range(dev, address + at, span,
+                                          expect + at, bad)) == -1)
+                return -1;
+            marked += n;
+        }
+    }
+    
+    /* Anything short of a block is just read */
+    if(done < length) {
+        if((n = device_readback_range(dev, address + done, length - done,
+                                      expect + done, bad)) == -1)
+            return -1;
+        marked += n;
+    }
+    
+    return marked;
+}
+
+/* Mark the rows of length bytes of flash at address that differ from
+ * expect in bad, by CRC if the bootloader can do them. Returns the number
+ * of rows newly marked, or -1. */
+static int
+device_verify_range(const struct device *dev, uint32_t address,
+                    uint32_t length, const uint8_t *expect, uint8_t *bad)
+{
+    if(dev->session->caps & AN851_CAP_CRC)
+        return device_crc_range(dev, address, length, expect, bad);
+    
+    return device_readback_range(dev, address, length, expect, bad);
+}
+
 int
 device_write_flash(struct device *dev, uint32_t address, uint32_t length, void *udata)
 {
+    int n;
     uint32_t i;
-    uint8_t *memory = (uint8_t *)udata;
-    uint8_t max = dev->opts.max_packet_size / BYTES_PER_BLOCK;
-    uint32_t nbytes = max * BYTES_PER_BLOCK;
+    uint8_t *memory = (uint8_t *)udata, *bad;
     
     /* The device's flash memory can hold flash_high+1 bytes of memory.
      * Writing to flash memory is a block operation, so convert this
      * to blocks [8 bytes per block on PIC18F microcontrollers] */
-    uint32_t blocks = length / BYTES_PER_BLOCK,
-             end    = address + length;
+    uint32_t blocks = length / BYTES_PER_BLOCK;
 
     if(!dev->state.connected)
         return -1;
@@ -354,61 +758,415 @@ device_write_flash(struct device *dev, uint32_t address, uint32_t length, void *
         return -1;
     }
         
-    /* Writing max_packet_size bytes at a time, in blocks */
-    for(i = 0; (i < blocks) && (address < end); i += max) {
-    
-        /* Adjust blocks to write if there are less than max_packet_size
-         * bytes to be written */
-        if(blocks - i < max) {
-            max = blocks - i;
-            nbytes = max * BYTES_PER_BLOCK;
-        }
-        
-        /* Utilize the device "scratch" buffer to enforce 8-byte alignment.
-         * The most data allowed to be written at any time is 250 bytes,
-         * so by using dev->buffer, it's alway aligned. */
-        memset(dev->buffer, 0xFF, DEVICE_BUFFER_SIZE);
-        memcpy(dev->buffer, &memory[address], nbytes);
-        if(an851_wr_flash(address, max, dev->buffer) == -1) {
-            rigel_error("writing flash memory\n");
+    /* Writing a packet at a time, in blocks */
+    dev->state.unchecked = 0;
+    for(i = 0; i < blocks; i += n) {
+        if((n = device_write_packet(dev, address, blocks - i, memory)) == -1)
             return -1;
-        }
         
         if(dev->update_func)
             dev->update_func(i, blocks);
         
-        /* If user wants to verify what has been written (very good idea!)
-         * read the block(s) we just wrote and compare it to what is in
-         * the HEX file */
-        if(dev->opts.verify_on_write) {
-            if(an851_rd_flash(address, nbytes, dev->buffer)  == -1 ||
-               memcmp(&memory[address], dev->buffer, nbytes) != 0) {
-                rigel_error("verifying flash write, address %06Xh!\n", address);
+        address += n * BYTES_PER_BLOCK;
+    }
+    
+    /* Without a plan there is nothing to repair with; just check. */
+    if(device_verify_all(dev)) {
+        address -= blocks * BYTES_PER_BLOCK;
+        if(!(bad = (uint8_t *)calloc(DEVICE_ROWS(address + length), 1))) {
+            rigel_error("allocating memory for row map!\n");
+            return -1;
+        }
+        n = device_verify_range(dev, address, blocks * BYTES_PER_BLOCK,
+                                memory + address, bad);
+        free(bad);
+        if(n != 0) {
+            if(n > 0)
+                rigel_error("verifying flash write, %d row(s) differ!\n", n);
+            return -1;
+        }
+    }
+        
+    return 0;
+}
+
+/* Send the operations of a plan, without verifying anything */
+static int
+device_send_plan(struct device *dev, const uint8_t *mem,
+                 const struct plan *plan)
+{
+    int n;
+    uint32_t i, end, done;
+    const struct plan_op *op;
+    
+    for(i = 0; i < plan->nops; i++) {
+        op = &plan->ops[i];
+        
+        if(op->op == PlanEraseRows) {
+            end = op->address + op->count * BYTES_PER_ROW;
+            if(op->address < dev->mem.flash_low ||
+               !VALID_FLASH(dev->mem, end - 1)) {
+                rigel_error("Cannot erase invalid flash region!\n");
+                return -1;
+            }
+            if(device_erase_rows(dev, op->address, op->count) == -1)
+                return -1;
+        } else {
+            end = op->address + op->count * BYTES_PER_BLOCK;
+            if(!VALID_FLASH(dev->mem, end - 1)) {
+                rigel_error("cannot write to invalid flash address!\n");
                 return -1;
             }
+            for(done = 0; done < op->count; done += n)
+                if((n = device_write_packet(dev, op->address +
+                                            done * BYTES_PER_BLOCK,
+                                            op->count - done, mem)) == -1)
+                    return -1;
         }
         
-        address += max * BYTES_PER_BLOCK;
+        if(dev->update_func)
+            dev->update_func(i + 1, plan->nops);
     }
-        
+    
     return 0;
 }
 
-int
-device_load_program(struct device *dev, void *mem, uint32_t start, uint32_t end)
+/* Read back what the write operations of plan wrote, merging them into
+ * runs so each read is as large as it can be, and mark the rows that
+ * differ from mem in bad. Returns the number of rows marked, or -1. */
+static int
+device_verify_plan(const struct device *dev, const uint8_t *mem,
+                   const struct plan *plan, uint8_t *bad)
+{
+    uint32_t i, j, from, to;
+    int n, marked = 0;
+    const struct plan_op *op;
+    
+    for(i = 0; i < plan->nops; i = j) {
+        op = &plan->ops[i];
+        j = i + 1;
+        if(op->op != PlanWriteBlocks)
+            continue;
+        
+        from = op->address;
+        to   = from + op->count * BYTES_PER_BLOCK;
+        for(; j < plan->nops; j++) {
+            op = &plan->ops[j];
+            if(op->op == PlanEraseRows)
+                continue;
+            if(op->address != to)
+                break;
+            to += op->count * BYTES_PER_BLOCK;
+        }
+        
+        if((n = device_verify_range(dev, from, to - from, mem + from,
+                                    bad)) == -1)
+            return -1;
+        marked += n;
+    }
+    
+    return marked;
+}
+
+/* Verify a plan that has been carried out, and erase and rewrite the
+ * rows that came out wrong until they all match (or we give up). */
+static int
+device_repair_plan(struct device *dev, const uint8_t *mem,
+                   const struct plan *plan)
 {
-    uint32_t psize;
+    uint32_t i, r, start = UINT32_MAX, end = 0;
+    int n, pass, ret = -1;
+    uint8_t *bad;
+    const struct plan_op *op;
+    const struct plan *check = plan;
+    struct plan *repair = NULL;
+    
+    for(i = 0; i < plan->nops; i++) {
+        op = &plan->ops[i];
+        if(op->op == PlanWriteBlocks) {
+            start = min(start, op->address);
+            end   = max(end, op->address + op->count * BYTES_PER_BLOCK);
+        }
+    }
+    if(end == 0)
+        return 0;
+    
+    if(!(bad = (uint8_t *)malloc(DEVICE_ROWS(end)))) {
+        rigel_error("allocating memory for row map!\n");
+        return -1;
+    }
+    
+    for(pass = 0; ; pass++) {
+        memset(bad, 0, DEVICE_ROWS(end));
+        if((n = device_verify_plan(dev, mem, check, bad)) <= 0) {
+            ret = n;
+            break;
+        }
         
-    /* Assure we're loading a program that's not too big for our device. */
-    if(!VALID_FLASH(dev->mem, end)) {
-        rigel_error("device_load_program: program will not fit on device!\n");
+        /* Rows in the boot block can't be erased, and writing over them
+         * again can't set the bits that came out wrong. */
+        for(r = 0; !bad[r]; r++) ;
+        if(r * BYTES_PER_ROW < dev->mem.flash_low) {
+            rigel_error("boot block row at %06Xh differs, and can't be "
+                        "erased to rewrite it!\n", r * BYTES_PER_ROW);
+            break;
+        }
+        if(pass == DEVICE_REPAIR_PASSES) {
+            rigel_error("%d row(s) from %06Xh on still differ after %d "
+                        "rewrites!\n", n, r * BYTES_PER_ROW, pass);
+            break;
+        }
+        rigel_warn("%d row(s) from %06Xh on differ; rewriting them.\n",
+                   n, r * BYTES_PER_ROW);
+        
+        /* Only the rows marked bad are in the repair plan, which stops
+         * short of the boot block. No other row is known to be blank on
+         * the device, so bad is the map of erasable rows too. */
+        plan_free(repair);
+        if(!(repair = plan_build(mem, max(start, dev->mem.flash_low), end,
+                                 bad, bad,
+                                 dev->mem.flash_low,
+                                 device_erased_byte(dev),
+                                 DEVICE_MAX_WRITE / BYTES_PER_BLOCK))) {
+            rigel_error("planning flash load!\n");
+            break;
+        }
+        if(device_send_plan(dev, mem, repair) == -1)
+            break;
+        check = repair;
+    }
+    
+    plan_free(repair);
+    free(bad);
+    return ret;
+}
+
+int
+device_run_plan(struct device *dev, void *umem, const struct plan *plan)
+{
+    const uint8_t *mem = (const uint8_t *)umem;
+    
+    if(!dev->state.connected)
+        return -1;
+    
+    dev->state.unchecked = 0;
+    if(device_send_plan(dev, mem, plan) == -1)
         return -1;
+    
+    if(device_verify_all(dev))
+        return device_repair_plan(dev, mem, plan);
+    return 0;
+}
+
+/* Plan and load the rows of mem between start and end that are marked in
+ * dirty (or all of them), erasing other rows only if they are marked in
+ * erasable (see plan_build). */
+static int
+device_load_plan(struct device *dev, void *mem, uint32_t start,
+                 uint32_t end, const uint8_t *dirty, const uint8_t *erasable)
+{
+    int ret;
+    struct plan *plan;
+    
+    if(!(plan = plan_build((const uint8_t *)mem, start, end, dirty,
+                           erasable, dev->mem.flash_low,
+                           device_erased_byte(dev),
+                           DEVICE_MAX_WRITE / BYTES_PER_BLOCK))) {
+        rigel_error("planning flash load!\n");
+        return -1;
+    }
+    
+    ret = device_run_plan(dev, mem, plan);
+    plan_free(plan);
+    
+    return ret;
+}
+
+/* Lay out the part of img that lies in flash in a buffer indexed by
+ * address, up to the end of the last row holding data, and mark the rows
+ * holding data in a row map (see DEVICE_ROWS). Returns the buffer, to be
+ * freed along with *rows, or NULL if the image has no data in flash or
+ * won't fit on the device. */
+static uint8_t *
+device_flash_window(const struct device *dev, const struct image *img,
+                    uint32_t *start, uint32_t *end, uint8_t **rows)
+{
+    uint32_t i, r, last, high = dev->mem.flash_high + 1;
+    const struct image_segment *seg;
+    uint8_t *mem;
+    
+    /* Assure we're loading a program that's not too big for our device;
+     * only configuration data may lie past the end of flash. */
+    if(image_bounds(img, high, dev->mem.config_low, &i, &r)) {
+        rigel_error("program will not fit on device!\n");
+        return NULL;
+    }
+    if(!image_bounds(img, 0, high, start, end)) {
+        rigel_error("program has no data for flash memory!\n");
+        return NULL;
+    }
+    *end = DEVICE_ROWS(*end) * BYTES_PER_ROW;
+    
+    mem   = (uint8_t *)malloc(*end);
+    *rows = (uint8_t *)calloc(DEVICE_ROWS(*end), 1);
+    if(!mem || !*rows) {
+        rigel_error("allocating memory for flash image!\n");
+        free(mem);
+        free(*rows);
+        return NULL;
     }
-    if(start < dev->mem.flash_low && !(dev->config.C6H & WRTB))
+    image_get(img, 0, mem, *end);
+    
+    for(i = 0; i < img->nsegs; i++) {
+        seg = &img->segs[i];
+        if(seg->address >= *end)
+            break;
+        last = DEVICE_ROWS(min(seg->address + seg->length, *end));
+        for(r = seg->address / BYTES_PER_ROW; r < last; r++)
+            (*rows)[r] = 1;
+    }
+    
+    return mem;
+}
+
+struct plan *
+device_plan_program(const struct device *dev, const struct image *img,
+                    uint8_t max_blocks, uint8_t **mem)
+{
+    uint32_t start, end;
+    uint8_t *rows;
+    struct plan *plan;
+    
+    if(!(*mem = device_flash_window(dev, img, &start, &end, &rows)))
+        return NULL;
+    
+    /* Only the rows holding data are erased and written; the planner
+     * folds blank rows between them into the erases, as erasing the whole
+     * span would have. */
+    if(!(plan = plan_build(*mem, start, end, rows, NULL,
+                           dev->mem.flash_low, device_erased_byte(dev),
+                           max_blocks))) {
+        rigel_error("planning flash load!\n");
+        free(*mem);
+    }
+    
+    free(rows);
+    return plan;
+}
+
+int
+device_load_program(struct device *dev, const struct image *img)
+{
+    int ret;
+    uint8_t *mem;
+    struct plan *plan;
+    
+    if(!(plan = device_plan_program(dev, img,
+                                    DEVICE_MAX_WRITE / BYTES_PER_BLOCK,
+                                    &mem)))
+        return -1;
+    
+    if(image_outside(img, dev->mem.flash_low, UINT32_MAX) &&
+       !(dev->config.C6H & WRTB))
         rigel_warn("Program file specifies write address in write-protected "
              "boot sector.\n");
 
-    psize = end - start + 1;
+    ret = device_run_plan(dev, mem, plan);
+    
+    plan_free(plan);
+    free(mem);
+    return ret;
+}
+
+uint8_t
+device_erased_byte(const struct device *dev)
+{
+    /* IFI loaders, for whatever reason, clear all the bits
+     * of program memory instead of doing the normal operation
+     * of setting them (writing only clears bits). */
+    return (dev->is_ifi) ? 0x00 : 0xFF;
+}
+
+int
+device_diff_flash(const struct device *dev, const struct image *img,
+                  uint8_t *dirty)
+{
+    uint8_t *mem, *rows, buffer[DEVICE_BUFFER_SIZE];
+    uint32_t start, end, addr, run, c, len, changed = 0;
+    uint32_t done = 0, total = 0;
+    int ret = -1;
+    
+    /* Read back whole rows at a time, as many as fit in a packet. */
+    uint32_t chunk = dev->opts.read_packet_size -
+                     (dev->opts.read_packet_size % BYTES_PER_ROW);
+    if(chunk == 0)
+        chunk = BYTES_PER_ROW;
+    
+    if(!dev->state.connected)
+        return -1;
+    
+    if(!(mem = device_flash_window(dev, img, &start, &end, &rows)))
+        return -1;
+    
+    /* Rows are the unit of erasure, so compare whole rows; nothing
+     * in the boot block is ever rewritten, and rows the image holds no
+     * data for are left alone. */
+    memset(dirty, 0, DEVICE_ROWS(end));
+    memset(rows, 0, min(DEVICE_ROWS(end),
+                        dev->mem.flash_low / BYTES_PER_ROW));
+    for(c = 0; c < DEVICE_ROWS(end); c++)
+        total += rows[c];
+    
+    for(addr = 0; addr < end; addr = run) {
+        if(!rows[addr / BYTES_PER_ROW]) {
+            run = addr + BYTES_PER_ROW;
+            continue;
+        }
+        for(run = addr; run < end && run - addr < chunk &&
+                        rows[run / BYTES_PER_ROW]; run += BYTES_PER_ROW) ;
+        len = run - addr;
         
-    return device_write_flash(dev, start, psize, mem);
+        if(an851_rd_flash(dev->session, addr, len, buffer) == -1) {
+            rigel_error("reading flash memory\n");
+            goto out;
+        }
+        
+        for(c = 0; c < len; c += BYTES_PER_ROW) {
+            if(memcmp(buffer + c, mem + addr + c, BYTES_PER_ROW) != 0) {
+                dirty[(addr + c) / BYTES_PER_ROW] = 1;
+                changed++;
+            }
+        }
+        
+        done += len / BYTES_PER_ROW;
+        if(dev->update_func)
+            dev->update_func(done, total);
+    }
+    ret = changed;
+    
+out:
+    free(mem);
+    free(rows);
+    return ret;
+}
+
+int
+device_load_rows(struct device *dev, const struct image *img,
+                 const uint8_t *dirty)
+{
+    int ret;
+    uint32_t start, end;
+    uint8_t *mem, *rows;
+    
+    if(!(mem = device_flash_window(dev, img, &start, &end, &rows)))
+        return -1;
+    
+    /* Rows the image holds no data for weren't compared, and must be
+     * left alone; the clean ones that were hold what the image does. */
+    ret = device_load_plan(dev, mem, max(start, dev->mem.flash_low),
+                           end, dirty, rows);
+    
+    free(mem);
+    free(rows);
+    return ret;
 }
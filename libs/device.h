@@ -27,17 +27,62 @@
 #include "rigel-defs.h"
 #include "an851.h"
 #include "pic18.h"
+#include "planner.h"
+#include "image.h"
 
 #define DEVICE_NAME_LEN 16
 #define DEVICE_BUFFER_SIZE 256
 
 
+/* Largest flash write payload, in whole blocks, that fits in a packet */
+#define DEVICE_MAX_WRITE \
+     ((MAX_DATA_LENGTH / BYTES_PER_BLOCK) * BYTES_PER_BLOCK)
+
+/* Clean writes in a row after which the write size grows by a row */
+#define DEVICE_RAMP_WRITES 4
+
+/* Values of opts.verify_on_write: read back every packet straight after
+ * writing it, or read back everything a flash load wrote once it is all
+ * written, with full size reads, and rewrite the rows that differ.
+ * DEVICE_VERIFY_SAMPLE (see device_set_sampling) only reads back a random
+ * share of the packets, and every packet that needed a retry, until one
+ * of them differs; from then on it verifies as DEVICE_VERIFY_AFTER does. */
+#define DEVICE_VERIFY_NONE   0
+#define DEVICE_VERIFY_EACH   1
+#define DEVICE_VERIFY_AFTER  2
+#define DEVICE_VERIFY_SAMPLE 3
+
+/* Most times rows that fail DEVICE_VERIFY_AFTER are rewritten before the
+ * load is given up on */
+#define DEVICE_REPAIR_PASSES 3
+
+/* Most flash read packets a bootloader with RD_RANGE is asked to stream
+ * back for one request; the progress callback is called between them. */
+#define DEVICE_RANGE_PACKETS 16
+
+/* Most flash one device_read_range call of dev reads */
+#define DEVICE_READ_SIZE(dev) \
+     ((uint32_t)(dev)->opts.read_packet_size * \
+      (((dev)->session->caps & AN851_CAP_RANGE) ? DEVICE_RANGE_PACKETS : 1))
+
+/* Bytes of flash each CRC covers when a bootloader with RD_CRC verifies a
+ * load; only spans whose CRC is wrong are read back to find the rows. */
+#define DEVICE_CRC_SPAN (4 * BYTES_PER_ROW)
+
 #define VALID_FLASH(m, a) \
      ((a) <= (m).flash_high)
+
+/* Number of flash rows needed to cover addresses below end; the size of
+ * a dirty row map (see device_diff_flash) for a program whose flash data
+ * ends at end. */
+#define DEVICE_ROWS(end) \
+     (((end) + BYTES_PER_ROW - 1) / BYTES_PER_ROW)
     
 /* All functions in this library return -1 on failure and 0 on 
  * success. Any function can fail if a serial communication error
- * occurs. This library is NOT re-entrant. */
+ * occurs. Each device carries its own AN851 session, so different
+ * devices may be driven from different threads; a single device
+ * must only be used by one thread at a time. */
  
 /* Structure representing everything associated with a device:
  * dev_id: uint16_t value sent from device identifying chip
@@ -52,8 +97,17 @@
  *     for example.
  *
  * opts: connection file descriptor and options set by the program
- *     (verify data [eeprom/flash] on write, maximum data to be sent
- *     for a packet)
+ *     (verify data [eeprom/flash] on write, see DEVICE_VERIFY_EACH, with
+ *     the share of writes and seed for DEVICE_VERIFY_SAMPLE;
+ *     maximum data to be sent for a packet). max_packet_size is what is known to work; reads use
+ *     read_packet_size, probed on connect, and writes write_packet_size,
+ *     which grows from max_packet_size while writes go through cleanly
+ *     and drops back when they need retrying. replicate (on by default)
+ *     lets a write of the same blocks as the one before it be sent as an
+ *     AN851 replicate command, without the data.
+ *
+ * session: the AN851 connection to the device, created by device_connect
+ *     and released by device_disconnect.
  *
  * status_callback: optional function pointer to a routine to be used
  *     whenever real-time data is needed from the device_x functions
@@ -73,13 +127,23 @@ typedef struct device {
     struct __opts {
         int fd;
         uint8_t verify_on_write;
+        uint8_t verify_percent;
+        uint32_t verify_seed;
         uint8_t max_packet_size;
+        uint8_t read_packet_size, write_packet_size;
+        uint8_t replicate;
         int rlag, wlag;
     } opts;
+    
+    struct an851_session *session;
 
     struct __dev_state {
         uint8_t connected;
         int tx_count, rx_count;
+        int clean_writes;
+        uint32_t sample;     /* Random state for DEVICE_VERIFY_SAMPLE */
+        uint8_t verify_all;  /* A sampled write differed */
+        uint32_t unchecked;  /* Writes of this load not yet known good */
         int refcount_allocs;
     } state;
     
@@ -107,6 +171,12 @@ int device_disconnect(struct device *dev);
 /* Reset the device (bringing it back into bootloader mode) */    
 void device_reset(const struct device *dev);
 
+/* Fill in stats (unless it is NULL) with the statistics of every AN851
+ * command sent to the device so far, AN851_COMMAND_SLOTS of them indexed
+ * by AN851_SLOT, and bring state.tx_count and state.rx_count (frames sent
+ * and responses received) up to date. Also done by device_disconnect. */
+void device_get_stats(struct device *dev, struct an851_stats *stats);
+
 /* Run the current program on the device - you can't get back into
  * bootloader mode after making this call. */
 void device_run_program(const struct device *dev);
@@ -124,6 +194,19 @@ long device_get_id(struct device *dev);
 void device_set_callback(struct device *dev,
                          DeviceUpdateCallback cb);
 
+/* Spot-check writes (DEVICE_VERIFY_SAMPLE): read back percent percent of
+ * them, picked at random from seed, plus every one that was retried.
+ * Report the seed, so that the same writes can be picked again. */
+void device_set_sampling(struct device *dev,
+                         uint8_t percent,
+                         uint32_t seed);
+
+/* Whether a write that took retries retransmissions (-1 if it never got
+ * an acknowledgement) should be read back straight away: always, unless
+ * verification is off, or only if it was sampled. For writes that can't
+ * wait for a bulk pass at the end (EEPROM, flash scripts). */
+int device_check_write(struct device *dev, int retries);
+
 /* Erase any number of rows (64 bytes) from the flash memory of the device. */
 int device_erase_flash(const struct device *dev,
                        uint32_t address,
@@ -137,16 +220,64 @@ int device_read_flash(const struct device *dev,
                       uint32_t length,
                       void *data);
 
+/* Read length bytes of flash, up to DEVICE_READ_SIZE(dev), at address
+ * with a single request: a streamed RD_RANGE if the bootloader has it,
+ * or one RD_FLASH. No checks and no progress; returns -1 on failure. */
+int device_read_range(const struct device *dev,
+                      uint32_t address,
+                      uint32_t length,
+                      void *data);
+
 int device_write_flash(struct device *dev,
                        uint32_t address,
                        uint32_t length,
                        void *data);
 
-
+/* Load the flash data in the program image img, following a plan from
+ * plan_build. Only rows the image holds data for are erased and written
+ * (along with any blank rows between them), and blocks that hold the
+ * erased value (see device_erased_byte) are skipped, so gaps in the image
+ * cost nothing to load. Data past the end of flash is an error, apart
+ * from configuration data, which is left alone. */
 int device_load_program(struct device *dev,
-                        void *mem,
-                        uint32_t start,
-                        uint32_t end);
+                        const struct image *img);
+
+/* Plan loading img as device_load_program does, writing at most
+ * max_blocks blocks per packet. *mem is set to the flash data of the image
+ * indexed by address, which the plan writes from; free it along with the
+ * plan. Returns NULL if the image can't be loaded on the device. */
+struct plan *device_plan_program(const struct device *dev,
+                                 const struct image *img,
+                                 uint8_t max_blocks,
+                                 uint8_t **mem);
+
+/* The value of flash memory after it has been erased: 0xFF normally, but
+ * 0x00 when the IFI erase extension (IFI_WR_ROW) is used. */
+uint8_t device_erased_byte(const struct device *dev);
+
+/* Compare the flash memory of the device with the program image img,
+ * one row at a time, reading back only the rows the image holds data
+ * for. dirty is indexed by row number (address divided by BYTES_PER_ROW)
+ * and must hold DEVICE_ROWS(end) entries, end being the end of the
+ * image's flash data; each row is set to 1 if it differs from the image
+ * and 0 if not. Returns the number of rows that differ. */
+int device_diff_flash(const struct device *dev,
+                      const struct image *img,
+                      uint8_t *dirty);
+
+/* Erase and rewrite only the rows of img that are marked in dirty (as
+ * filled in by device_diff_flash), as device_load_program. */
+int device_load_rows(struct device *dev,
+                     const struct image *img,
+                     const uint8_t *dirty);
+
+/* Carry out each operation of a plan (see planner.h) in order, writing
+ * from mem. Progress is reported in operations. With DEVICE_VERIFY_AFTER,
+ * everything the plan wrote is then read back, and rows that differ are
+ * erased and rewritten, up to DEVICE_REPAIR_PASSES times. */
+int device_run_plan(struct device *dev,
+                    void *mem,
+                    const struct plan *plan);
 
 /* EEPROM operations. */
 int device_write_eeprom(struct device *dev,
@@ -0,0 +1,215 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "image.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Segments allocated for a new image, and bytes for a new segment; both
+ * are doubled whenever they fill up. */
+#define IMAGE_INITIAL_SEGMENTS 8
+#define IMAGE_INITIAL_DATA     0x400
+
+#define SEGMENT_END(s) ((s)->address + (s)->length)
+
+struct image *
+image_alloc(uint8_t fill)
+{
+    struct image *img;
+
+    if(!(img = (struct image *)calloc(1, sizeof(struct image))))
+        return NULL;
+    if(!(img->segs = (struct image_segment *)
+         malloc(IMAGE_INITIAL_SEGMENTS * sizeof(struct image_segment)))) {
+        free(img);
+        return NULL;
+    }
+    img->size = IMAGE_INITIAL_SEGMENTS;
+    img->fill = fill;
+
+    return img;
+}
+
+void
+image_free(struct image *img)
+{
+    uint32_t i;
+
+    if(img) {
+        for(i = 0; i < img->nsegs; i++)
+            free(img->segs[i].data);
+        free(img->segs);
+        free(img);
+    }
+}
+
+/* Make room for at least length bytes in a segment */
+static int
+image_reserve(struct image_segment *seg, uint32_t length)
+{
+    uint8_t *data;
+    uint32_t size = seg->size ? seg->size : IMAGE_INITIAL_DATA;
+
+    while(size < length)
+        size *= 2;
+    if(size == seg->size)
+        return 0;
+
+    if(!(data = (uint8_t *)realloc(seg->data, size)))
+        return -1;
+    seg->data = data;
+    seg->size = size;
+
+    return 0;
+}
+
+/* Open up an empty segment at index i */
+static struct image_segment *
+image_insert(struct image *img, uint32_t i, uint32_t address)
+{
+    struct image_segment *segs;
+
+    if(img->nsegs == img->size) {
+        if(!(segs = (struct image_segment *)
+             realloc(img->segs, 2 * img->size *
+                     sizeof(struct image_segment))))
+            return NULL;
+        img->segs = segs;
+        img->size *= 2;
+    }
+
+    memmove(&img->segs[i + 1], &img->segs[i],
+            (img->nsegs - i) * sizeof(struct image_segment));
+    img->nsegs++;
+
+    memset(&img->segs[i], 0, sizeof(struct image_segment));
+    img->segs[i].address = address;
+
+    return &img->segs[i];
+}
+
+int
+image_put(struct image *img, uint32_t address,
+          const void *data, uint32_t length)
+{
+    struct image_segment *seg, *last;
+    uint32_t i, j, start, end = address + length;
+
+    if(length == 0)
+        return 0;
+
+    /* Find the segments this write overlaps or touches: [i, j) */
+    last = img->nsegs ? &img->segs[img->nsegs - 1] : NULL;
+    if(!last || SEGMENT_END(last) <= address) {
+        i = img->nsegs - (last && SEGMENT_END(last) == address);
+        j = img->nsegs;
+    } else {
+        for(i = 0; i < img->nsegs && SEGMENT_END(&img->segs[i]) < address;
+            i++) ;
+        for(j = i; j < img->nsegs && img->segs[j].address <= end; j++) ;
+    }
+
+    if(i == j) {
+        if(!(seg = image_insert(img, i, address)))
+            return -1;
+    } else {
+        /* Grow the first of them to cover the rest and the new data,
+         * then drop the others. */
+        seg   = &img->segs[i];
+        start = min(seg->address, address);
+        end   = max(SEGMENT_END(&img->segs[j - 1]), end);
+
+        if(image_reserve(seg, end - start) == -1)
+            return -1;
+        if(start < seg->address) {
+            memmove(seg->data + (seg->address - start), seg->data,
+                    seg->length);
+            seg->address = start;
+        }
+        for(; j - 1 > i; j--) {
+            memcpy(seg->data + (img->segs[i + 1].address - start),
+                   img->segs[i + 1].data, img->segs[i + 1].length);
+            free(img->segs[i + 1].data);
+            memmove(&img->segs[i + 1], &img->segs[i + 2],
+                    (img->nsegs - i - 2) * sizeof(struct image_segment));
+            img->nsegs--;
+        }
+    }
+
+    if(image_reserve(seg, max(seg->length, end - seg->address)) == -1)
+        return -1;
+    memcpy(seg->data + (address - seg->address), data, length);
+    seg->length = max(seg->length, end - seg->address);
+
+    return 0;
+}
+
+void
+image_get(const struct image *img, uint32_t address,
+          void *uout, uint32_t length)
+{
+    uint8_t *out = (uint8_t *)uout;
+    uint32_t i, from, to, end = address + length;
+    const struct image_segment *seg;
+
+    memset(out, img->fill, length);
+    for(i = 0; i < img->nsegs; i++) {
+        seg = &img->segs[i];
+        if(seg->address >= end)
+            break;
+        if(SEGMENT_END(seg) <= address)
+            continue;
+
+        from = max(seg->address, address);
+        to   = min(SEGMENT_END(seg), end);
+        memcpy(out + (from - address), seg->data + (from - seg->address),
+               to - from);
+    }
+}
+
+int
+image_bounds(const struct image *img, uint32_t low, uint32_t high,
+             uint32_t *start, uint32_t *end)
+{
+    uint32_t i;
+    int found = 0;
+    const struct image_segment *seg;
+
+    for(i = 0; i < img->nsegs; i++) {
+        seg = &img->segs[i];
+        if(seg->address >= high)
+            break;
+        if(SEGMENT_END(seg) <= low)
+            continue;
+
+        if(!found)
+            *start = max(seg->address, low);
+        *end = min(SEGMENT_END(seg), high);
+        found = 1;
+    }
+
+    return found;
+}
+
+int
+image_outside(const struct image *img, uint32_t low, uint32_t high)
+{
+    return img->nsegs &&
+           (img->segs[0].address < low ||
+            SEGMENT_END(&img->segs[img->nsegs - 1]) > high);
+}
@@ -0,0 +1,68 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/* librigel API for sparse program images: the data read from a program
+ * file, kept as a sorted list of populated address ranges rather than a
+ * flat buffer covering every address up to the end. */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include "rigel-defs.h"
+
+#include <sys/types.h>
+
+/* A populated range of the image. Segments never overlap or touch;
+ * data written next to a segment extends it. */
+struct image_segment {
+    uint32_t address, length;
+    uint32_t size;      /* Bytes allocated for data */
+    uint8_t *data;
+};
+
+struct image {
+    struct image_segment *segs;     /* In address order */
+    uint32_t nsegs, size;
+
+    uint8_t fill;       /* Value of every address outside the segments */
+};
+
+/* Returns an empty image to be freed with image_free, or NULL. */
+struct image *image_alloc(uint8_t fill);
+void image_free(struct image *img);
+
+/* Store length bytes of data at address, replacing whatever the image
+ * held there. Writing in address order (as program files usually are)
+ * just extends the last segment. */
+int image_put(struct image *img, uint32_t address,
+              const void *data, uint32_t length);
+
+/* Copy length bytes from address into out, with the image's fill value
+ * wherever it holds no data. */
+void image_get(const struct image *img, uint32_t address,
+               void *out, uint32_t length);
+
+/* Find the lowest and highest (exclusive) populated addresses between
+ * low and high, storing them in start and end. Returns 0 if there is
+ * no data there at all, or 1. */
+int image_bounds(const struct image *img, uint32_t low, uint32_t high,
+                 uint32_t *start, uint32_t *end);
+
+/* Whether the image holds any data outside low to high */
+int image_outside(const struct image *img, uint32_t low, uint32_t high);
+
+#endif /* _IMAGE_H */
@@ -20,53 +20,159 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 #include "inhex32.h"
+#include "pic18.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+const char *inhex32_map(const char *fn, size_t * length)
+{
+	int fd;
+	struct stat st;
+	void *data;
+
+	if ((fd = open(fn, O_RDONLY)) == -1) {
+		rigel_error("could not open file %s!\n", fn);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		rigel_error("reading %s: %s\n", fn, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	/* mmap() refuses empty mappings; an empty file is simply no data. */
+	*length = st.st_size;
+	if (*length == 0) {
+		close(fd);
+		return "";
+	}
+
+	data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		rigel_error("mapping %s: %s\n", fn, strerror(errno));
+		return NULL;
+	}
+	madvise(data, *length, MADV_SEQUENTIAL);
+
+	return (const char *)data;
+}
+
+void inhex32_unmap(const char *data, size_t length)
+{
+	if (data && length)
+		munmap((void *)data, length);
+}
+
+/* Copy the next line of a mapped file into buf (NUL-terminated, and cut
+ * short if it does not fit), advancing *p past it. Returns 0 at the end
+ * of the file. */
+static int inhex32_next_line(const char **p, const char *end,
+			     char *buf, size_t bufsize)
+{
+	const char *eol;
+	size_t len;
+
+	if (*p >= end)
+		return 0;
+
+	if (!(eol = memchr(*p, '\n', end - *p)))
+		eol = end;
+
+	len = min((size_t) (eol - *p), bufsize - 1);
+	memcpy(buf, *p, len);
+	buf[len] = '\0';
+
+	*p = (eol < end) ? eol + 1 : end;
+	return 1;
+}
+
+
+/* Hex digit values, with 0x10 set on every valid digit so that anything
+ * else (including the terminating NUL) decodes as 0. */
+#define HEXDIGIT(c, v) [c] = 0x10 | (v)
+static const uint8_t hex_digits[256] = {
+	HEXDIGIT('0', 0x0), HEXDIGIT('1', 0x1), HEXDIGIT('2', 0x2),
+	HEXDIGIT('3', 0x3), HEXDIGIT('4', 0x4), HEXDIGIT('5', 0x5),
+	HEXDIGIT('6', 0x6), HEXDIGIT('7', 0x7), HEXDIGIT('8', 0x8),
+	HEXDIGIT('9', 0x9),
+	HEXDIGIT('A', 0xA), HEXDIGIT('B', 0xB), HEXDIGIT('C', 0xC),
+	HEXDIGIT('D', 0xD), HEXDIGIT('E', 0xE), HEXDIGIT('F', 0xF),
+	HEXDIGIT('a', 0xA), HEXDIGIT('b', 0xB), HEXDIGIT('c', 0xC),
+	HEXDIGIT('d', 0xD), HEXDIGIT('e', 0xE), HEXDIGIT('f', 0xF)
+};
+#undef HEXDIGIT
+
+/* Decode count hex pairs from line into out, stopping at the first
+ * character that is not a hex digit. Returns the sum of the decoded
+ * bytes, or -1. */
+static int inhex32_decode(const char *line, uint8_t * out, int count)
+{
+	int sum = 0;
+	uint8_t hi, lo;
+
+	while (count--) {
+		if (!(hi = hex_digits[(uint8_t) * line++]))
+			return -1;
+		if (!(lo = hex_digits[(uint8_t) * line++]))
+			return -1;
+
+		*out = (uint8_t) ((hi << 4) | (lo & 0x0F));
+		sum += *out++;
+	}
+
+	return sum;
+}
 
 static int inhex32_parse_line(const char *line, struct inhex32_record *rec)
 {
-	int c, chk;
+	int chk, sum;
+	uint8_t header[4];
 	static uint16_t address_ext = 0;
 	static int address_mode = LiteralAddressMode;
 
 	if (!line || *line++ != ':')
 		return -1;
 
-	/* Scan out the following ASCII hex data: byte dword byte */
-	if (sscanf(line, "%02hhX%04X%02hhX", &rec->length,
-		   &rec->address, &rec->record_type) != 3)
+	/* Header: length byte, address word, record type byte */
+	if ((chk = inhex32_decode(line, header, 4)) == -1)
 		return -1;
+	rec->length = header[0];
+	rec->address = (header[1] << 8) | header[2];
+	rec->record_type = header[3];
 
 	/* We have reached the end of the hex file, stop. */
 	if (rec->record_type == INHEX_EOF)
 		return 0;
 
-	/* Skip to the data section of the record and read rec.length bytes */
-	line += 8;
-	for (c = 0; c < rec->length; c++) {
-		if (sscanf(line, "%02hhX", &rec->data[c]) != 1)
-			return -1;
-
-		line += 2;
+	if (rec->length > sizeof(rec->data)) {
+		rigel_error("Parse error: record length %02X too long\n",
+			    rec->length);
+		return -1;
 	}
 
-	/* Get the checksum and validate our data against it */
-	if (sscanf(line, "%02hhX", &rec->checksum) != 1)
+	/* Data section, then the checksum */
+	line += 8;
+	if ((sum = inhex32_decode(line, rec->data, rec->length)) == -1)
+		return -1;
+	chk += sum;
+
+	line += 2 * rec->length;
+	if (inhex32_decode(line, &rec->checksum, 1) == -1)
 		return -1;
 
 	/* Intel HEX checksum == two's complement of the sum of the bytes
 	 * represented by the file (includes address and length) */
-	chk = rec->length;
-	chk += rec->record_type;
-	chk += HIBYTE(rec->address) + LOBYTE(rec->address);
-
-	for (c = 0; c < rec->length; c++)
-		chk += rec->data[c];
-
 	chk = ((~chk & 0xFF) + 1) & 0xFF;
 	if (chk != rec->checksum) {
 		rigel_error("Parse error: checksum mismatch - calculated %02X, "
@@ -106,38 +212,108 @@ static int inhex32_parse_line(const char *line, struct inhex32_record *rec)
 
 int inhex32_validate(const char *fn)
 {
-	int line = 0;
+	int ret = 0;
 	char buf[64];
 	struct inhex32_record rec;
+	const char *map, *p;
+	size_t length;
 
-	FILE *fp = fopen(fn, "r");
-	if (!fp) {
-		rigel_error("could not open file %s!\n", fn);
+	if (!(map = inhex32_map(fn, &length)))
 		return -1;
-	}
-
-	while (!feof(fp)) {
-		fgets(buf, 64, fp);
-		line++;
 
-		if (inhex32_parse_line(buf, &rec) == -1)
-			return -1;
+	for (p = map; inhex32_next_line(&p, map + length, buf, sizeof(buf));) {
+		if (inhex32_parse_line(buf, &rec) == -1) {
+			ret = -1;
+			break;
+		}
 		if (rec.record_type == INHEX_EOF)
 			break;
 	}
 
-	fclose(fp);
+	inhex32_unmap(map, length);
 
+	return ret;
+}
+
+/* Output is formatted into a buffer of this size and written out in
+ * blocks; it is flushed whenever another line might not fit. */
+#define WRITE_BUFFER_SIZE 0x2000
+#define WRITE_LINE_MAX    64
+
+static const char hex_chars[] = "0123456789ABCDEF";
+
+/* Append the two hex digits of b at p, returning the end */
+static char *inhex32_put_byte(char *p, uint8_t b)
+{
+	*p++ = hex_chars[b >> 4];
+	*p++ = hex_chars[b & 0x0F];
+	return p;
+}
+
+/* Write out len bytes of buf when it is too full for another line (or
+ * always if force is set). Returns the new fill level, or -1. */
+static int inhex32_flush(FILE * out, const char *buf, size_t len, int force)
+{
+	if (!force && len + WRITE_LINE_MAX <= WRITE_BUFFER_SIZE)
+		return len;
+
+	if (fwrite(buf, 1, len, out) != len)
+		return -1;
 	return 0;
 }
 
-int inhex32_write(const char *fn, void *pmem, uint32_t start, uint32_t end)
+/* Format a data record of len bytes at addr into p, preceded by an
+ * extended linear address record if the upper address word has moved
+ * on from *ext. Returns the end of the output. */
+static char *inhex32_put_record(char *p, uint16_t * ext, uint32_t addr,
+				const uint8_t * data, int len)
 {
 	int c, chk;
+
+	/* If the current address exceeds the capacity of a word,
+	 * use the extended linear address directive. */
+	if (*ext != HIWORD(addr)) {
+		*ext = HIWORD(addr);
+		chk = 0x06 + HIBYTE(*ext) + LOBYTE(*ext);
+
+		p += sprintf(p, ":02000004");
+		p = inhex32_put_byte(p, HIBYTE(*ext));
+		p = inhex32_put_byte(p, LOBYTE(*ext));
+		p = inhex32_put_byte(p, (uint8_t) - chk);
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+
+	/* It is necessary to mask out the high byte of addr because
+	 * we can only output the last 2 bytes of the address. The
+	 * checksum is summed as the bytes go out. */
+	*p++ = ':';
+	p = inhex32_put_byte(p, len);
+	p = inhex32_put_byte(p, HIBYTE(addr));
+	p = inhex32_put_byte(p, LOBYTE(addr));
+	p = inhex32_put_byte(p, INHEX_DATA);
+	chk = len + HIBYTE(addr) + LOBYTE(addr) + INHEX_DATA;
+
+	for (c = 0; c < len; c++) {
+		p = inhex32_put_byte(p, data[c]);
+		chk += data[c];
+	}
+
+	/* End data segment with the checksum and newline (DOS) */
+	p = inhex32_put_byte(p, (uint8_t) - chk);
+	*p++ = '\r';
+	*p++ = '\n';
+
+	return p;
+}
+
+int inhex32_write(const char *fn, const struct image *img)
+{
+	int fill;
 	uint16_t ext = 0;
-	uint32_t addr;
-	uint8_t len = INHEX_MAX_DATA;
-	uint8_t *mem = (uint8_t *) pmem;
+	uint32_t i, off, len;
+	const struct image_segment *seg;
+	char buf[WRITE_BUFFER_SIZE], *p = buf;
 
 	FILE *out = fopen(fn, "w");
 
@@ -146,259 +322,315 @@ int inhex32_write(const char *fn, void *pmem, uint32_t start, uint32_t end)
 		return -1;
 	}
 
-	fprintf(out, ":020000040000FA\r\n");
+	p += sprintf(p, ":020000040000FA\r\n");
 
-	for (addr = start; addr < end; addr += len) {
-		if ((end - addr) < len)
-			len = (end - addr);
+	/* Only the populated parts of the image are written out. Records
+	 * stop at 64K boundaries, where the extended address changes. */
+	for (i = 0; i < img->nsegs; i++) {
+		seg = &img->segs[i];
 
-		/* If the current address exceeds the capacity of a word,
-		 * use the extended linear address directive. */
-		if (ext != HIWORD(addr)) {
-			ext = HIWORD(addr);
-			chk = 0x06 + HIBYTE(ext) + LOBYTE(ext);
-			chk = ((~chk & 0xFF) + 1) & 0xFF;
+		for (off = 0; off < seg->length; off += len) {
+			len = min(seg->length - off, INHEX_MAX_DATA);
+			len = min(len, 0x10000 - LOWORD(seg->address + off));
 
-			fprintf(out, ":02000004%04X%02X\r\n", ext, chk);
-		}
+			p = inhex32_put_record(p, &ext, seg->address + off,
+					       seg->data + off, len);
 
-		/* It is necessary to mask out the high byte of addr because
-		 * we can only output the last 2 bytes of the address. */
-		fprintf(out, ":%02X%04X%02X", len, addr & 0xFFFF, INHEX_DATA);
-		for (c = 0; c < len; c++)
-			fprintf(out, "%02X", mem[addr + c]);
-
-		chk = len;
-		chk += HIBYTE(addr);
-		chk += LOBYTE(addr);
-		chk += INHEX_DATA;
+			if ((fill = inhex32_flush(out, buf, p - buf, 0)) == -1)
+				goto error;
+			p = buf + fill;
+		}
+	}
 
-		for (c = 0; c < len; c++)
-			chk += mem[addr + c];
-		chk += 5 - 5;
-		chk = ((~chk & 0xFF) + 1) & 0xFF;
+	/* Print out the EOF and commit changes */
+	p += sprintf(p, ":00000001FF\r\n");
+	if (inhex32_flush(out, buf, p - buf, 1) == -1)
+		goto error;
 
-		/* End data segment with the checksum and newline (DOS) */
-		fprintf(out, "%02X\r\n", (uint8_t) chk);
+	if (fclose(out) != 0) {
+		rigel_error("writing HEX output file %s: %s\n", fn,
+			    strerror(errno));
+		return -1;
 	}
 
-	/* Print out the EOF and commit changes */
-	fprintf(out, ":00000001FF\r\n");
+	return 0;
+
+ error:
+	rigel_error("writing HEX output file %s: %s\n", fn, strerror(errno));
 	fclose(out);
+	return -1;
+}
 
-	return 0;
+/* Parse an Intel HEX file (output from mplink) into img, the map of
+ * the PIC memory we are to write. Configuration register records are
+ * kept along with everything else. */
+int inhex32_read(const char *fn, struct image *img)
+{
+	int line = 0, ret = -1;
+	char buf[64];
+	struct inhex32_record rec;
+	const char *map, *p;
+	size_t length;
+
+	if (!(map = inhex32_map(fn, &length)))
+		return -1;
+
+	memset(&rec, 0x00, sizeof(struct inhex32_record));
+
+	for (p = map; inhex32_next_line(&p, map + length, buf, sizeof(buf));) {
+		line++;
+
+		if (inhex32_parse_line(buf, &rec) == -1) {
+			rigel_error("Parsing inhex32 file at line %d.\n", line);
+			goto out;
+		}
+
+		if (rec.record_type == INHEX_EOF)
+			break;
+
+		if (rec.record_type == INHEX_DATA &&
+		    image_put(img, rec.address, rec.data, rec.length) == -1) {
+			rigel_error("out of memory!\n");
+			goto out;
+		}
+	}
+	ret = 0;
+
+ out:
+	inhex32_unmap(map, length);
+	return ret;
 }
 
-/* Parse an Intel HEX file (output from mplink) and return
- * a map of the PIC memory we are to write. */
 int
-inhex32_read(const char *fn, void *pmem,
-	     size_t memsize, uint32_t * start, uint32_t * end)
+inhex32_stream(const char *fn, void *pmem, size_t memsize,
+	       InhexRowFunc emit, void *arg)
 {
-	int line = 0;
+	int line = 0, ret = -1, warn_config_data = 0;
 	char buf[64];
 	struct inhex32_record rec;
 	uint8_t *picmem = (uint8_t *) pmem;
-	int warn_config_data = 0;
-
-	FILE *fp = fopen(fn, "r");
-
-	if (start && end)
-		*start = *end = 0;
+	uint8_t *pending = NULL;
+	uint32_t rows = memsize / BYTES_PER_ROW, low = 0, first, last, r;
+	FILE *fp;
 
-	if (!fp) {
+	if (strcmp(fn, "-") == 0)
+		fp = stdin;
+	else if (!(fp = fopen(fn, "r"))) {
 		rigel_error("could not open file %s!\n", fn);
-		goto error;
+		return -1;
+	}
+
+	/* Rows that have been filled in but not yet emitted */
+	if (!(pending = (uint8_t *) calloc(rows, 1))) {
+		rigel_error("out of memory!\n");
+		goto out;
 	}
 
 	memset(&rec, 0x00, sizeof(struct inhex32_record));
-	if (pmem)
-		memset(pmem, 0xFF, memsize);
+	memset(pmem, 0xFF, memsize);
 
-	while (!feof(fp)) {
-		fgets(buf, 64, fp);
+	while (fgets(buf, sizeof(buf), fp)) {
 		line++;
 
 		if (inhex32_parse_line(buf, &rec) == -1) {
 			rigel_error("Parsing inhex32 file at line %d.\n", line);
-			return -1;
+			goto out;
 		}
 
 		if (rec.record_type == INHEX_EOF)
 			break;
+		if (rec.record_type != INHEX_DATA || rec.length == 0)
+			continue;
 
-		/* If this is a data record, copy to picmem at the correct addr
-		 * and adjust max/min program addresses */
-		if (rec.record_type == INHEX_DATA) {
-			if (rec.address + rec.length > memsize) {
-				/* For some reason, MCC18 + MPLINK may generate configuration
-				 * data in the INHEX32 file. This data is not writable on the
-				 * FRC, so we ignore it (once per file). */
-				if (rec.address & CONFIG_REGISTER_MASK) {
-					if (pmem && !warn_config_data) {
-						rigel_warn
-						    ("Ignoring configuration register data present in %s.\n",
-						     fn);
-						warn_config_data = 1;
-					}
-					continue;
-				} else {
-					rigel_error
-					    ("buffer too small for input program!\n");
-					goto error;
+		if (rec.address + rec.length > memsize) {
+			if (rec.address & CONFIG_REGISTER_MASK) {
+				if (!warn_config_data) {
+					rigel_warn
+					    ("Ignoring configuration register data present in %s.\n",
+					     fn);
+					warn_config_data = 1;
 				}
+				continue;
 			}
-			if (pmem)
-				memcpy(&picmem[rec.address], rec.data,
-				       rec.length);
+			rigel_error("buffer too small for input program!\n");
+			goto out;
+		}
+		memcpy(&picmem[rec.address], rec.data, rec.length);
+
+		/* Every row below this record is complete, unless a later
+		 * record comes back to it. */
+		first = rec.address / BYTES_PER_ROW;
+		last = (rec.address + rec.length - 1) / BYTES_PER_ROW;
+		for (r = low; r < first; r++) {
+			if (!pending[r])
+				continue;
+			pending[r] = 0;
+			if (emit(r * BYTES_PER_ROW, &picmem[r * BYTES_PER_ROW],
+				 arg) == -1)
+				goto out;
+		}
 
-			if (start && end) {
-				if (*start == 0 && rec.address != 0)
-					*start = rec.address;
+		for (r = first; r <= last; r++)
+			pending[r] = 1;
+		low = first;
+	}
 
-				*start = min(*start, rec.address);
-				*end = max(*end, rec.address + rec.length);
-			}
-		}
+	if (ferror(fp)) {
+		rigel_error("reading %s: %s\n", fn, strerror(errno));
+		goto out;
 	}
 
-	fclose(fp);
-	return 0;
+	for (r = low; r < rows; r++)
+		if (pending[r] &&
+		    emit(r * BYTES_PER_ROW, &picmem[r * BYTES_PER_ROW],
+			 arg) == -1)
+			goto out;
+	ret = 0;
 
- error:
-	if (fp)
+ out:
+	free(pending);
+	if (fp != stdin)
 		fclose(fp);
-	return -1;
+	return ret;
 }
 
-int
-ifi_bin_read(const char *fn, void *buffer, size_t bufsize,
-	     uint32_t * start, uint32_t * end)
-{
-	int i, line_no = 1;
-	FILE *bin;
-	uint8_t *data;
-	uint32_t address, read_start, read_end;
-	char line[IFIBIN_LINE_LEN + 1], *temp;
+int ifi_bin_verbose = 0;
 
-	address = read_start = read_end = 0;
-	data = (uint8_t *) buffer;
+/* Each IFI .BIN line is a six digit address and IFIBIN_DATA_LEN bytes,
+ * each preceded by a space, ended by \r\n or \n. */
+#define IFIBIN_TEXT_LEN (6 + 3 * IFIBIN_DATA_LEN)
 
-	if (!(bin = fopen(fn, "r"))) {
-		rigel_error("opening %s for reading!\n", fn);
-		return -1;
-	}
-
-	int ret = fscanf(bin, "%06X", &read_start);
-	if (ret < 0) {
-		rigel_error("read read_start failed.");
-		fclose(bin);
-		return 0;
-	}
-	ret = fseek(bin, -IFIBIN_LINE_LEN, SEEK_END);
-	if (ret < 0) {
-		rigel_error("seek end-ifibin_line_len failed.");
-		fclose(bin);
-		return 0;
-	}
-	ret = fscanf(bin, "%06X", &read_end);
-	if (ret < 0) {
-		rigel_error("read read_end failed.");
-		fclose(bin);
-		return 0;
-	}
-
-	read_end += IFIBIN_DATA_LEN;
-	fprintf(stderr,"start: %06X  end: %06X\n", read_start, read_end);
-
-	if (read_end > bufsize) {
-		rigel_error
-		    ("IFI .bin parser: buffer too small for program data!\n");
-		fclose(bin);
+int ifi_bin_read(const char *fn, struct image *img)
+{
+	int i, line_no = 0, ret = -1;
+	uint8_t addr[3], data[IFIBIN_DATA_LEN];
+	uint32_t address, next = 0;
+	const char *map, *p, *q, *end;
+	const char *what;
+	size_t length;
+
+	if (!(map = inhex32_map(fn, &length)))
 		return -1;
-	}
+	end = map + length;
 
-	if (!data) {
-		*start = read_start;
-		*end = read_end;
-		return 1;
-	}
-	fseek(bin, 0, SEEK_SET);
-	memset(data, 0xFF, bufsize);
+	for (p = map; p < end;) {
+		line_no++;
 
-	while (!feof(bin)) {
-		if (!fgets(line, IFIBIN_LINE_LEN + 1, bin)) {
-			rigel_error("fgets dies. %s\n", strerror(errno));
-			return -1;
-		}
+		/* Trailing blank lines are allowed at the end of the file */
+		for (q = p; q < end && (*q == '\r' || *q == '\n'); q++) ;
+		if (q == end)
+			break;
 
-		fprintf(stderr, "got line %s\n", line);
-		temp = line;
+		what = "truncated line";
+		if (end - p < IFIBIN_TEXT_LEN)
+			goto error;
 
-		if (sscanf(temp, "%06X ", &address) != 1)
+		what = "bad address";
+		if (inhex32_decode(p, addr, 3) == -1)
 			goto error;
+		address = (addr[0] << 16) | (addr[1] << 8) | addr[2];
 
-		fprintf(stderr, "got address %06X\n", address);
+		what = "bad data byte";
+		for (i = 0; i < IFIBIN_DATA_LEN; i++)
+			if (p[6 + 3 * i] != ' ' ||
+			    inhex32_decode(p + 7 + 3 * i, &data[i], 1) == -1)
+				goto error;
+		p += IFIBIN_TEXT_LEN;
 
-		temp += 7;
+		what = "line too long";
+		if (p < end && *p == '\r')
+			p++;
+		if (p < end && *p++ != '\n')
+			goto error;
 
-		if (!data)
-			continue;
+		/* Lines come in address order and never overlap */
+		what = "address out of order";
+		if (line_no > 1 && address < next)
+			goto error;
+		next = address + IFIBIN_DATA_LEN;
 
-		for (i = 0; i < IFIBIN_DATA_LEN; i++) {
-			if (sscanf(temp, "%02hhX", &data[address + i]) != 1)
-				goto error;
+		if (ifi_bin_verbose)
+			fprintf(stderr, "IFI .bin line %d: %06X\n", line_no,
+				address);
 
-			fprintf(stderr, "got data[%06X + %X] = %02hhX\n",
-					address, i, data[address + i]);
-			temp += 2;
+		if (image_put(img, address, data, IFIBIN_DATA_LEN) == -1) {
+			rigel_error("out of memory!\n");
+			goto out;
 		}
 	}
-	fclose(bin);
 
-	if (start && end) {
-		*start = read_start;
-		*end = read_end;
-	}
-	return 0;
+	what = "no data";
+	if (next == 0)
+		goto error;
+
+	ret = 0;
+	goto out;
 
  error:
-	rigel_error("IFI .bin parse error on line %d!\n", line_no);
-	fclose(bin);
+	rigel_error("IFI .bin parse error on line %d: %s!\n", line_no, what);
 
-	return -1;
+ out:
+	inhex32_unmap(map, length);
+	return ret;
 }
 
-int ifi_bin_write(const char *fn, void *pmem, uint32_t start, uint32_t end)
+int ifi_bin_write(const char *fn, const struct image *img)
 {
 	FILE *out;
-	uint8_t len = IFIBIN_DATA_LEN;
-	uint8_t i, *data = (uint8_t *) pmem;
-	uint32_t addr;
+	int fill;
+	uint8_t len, i;
+	uint32_t addr, off, s;
+	const struct image_segment *seg;
+	char buf[WRITE_BUFFER_SIZE], *p = buf;
 
 	if (!(out = fopen(fn, "w"))) {
 		rigel_error("Cannot open %s for writing!\n", fn);
 		return -1;
 	}
 
-	for (addr = start; addr < end; addr += len) {
-		if (end - addr < len)
-			len = (end - addr);
+	for (s = 0; s < img->nsegs; s++) {
+		seg = &img->segs[s];
 
-		fprintf(out, "%06X", addr);
+		for (off = 0; off < seg->length; off += len) {
+			len = min(seg->length - off, IFIBIN_DATA_LEN);
+			addr = seg->address + off;
+
+			p = inhex32_put_byte(p, (addr >> 16) & 0xFF);
+			p = inhex32_put_byte(p, HIBYTE(addr));
+			p = inhex32_put_byte(p, LOBYTE(addr));
+
+			for (i = 0; i < len; i++) {
+				*p++ = ' ';
+				p = inhex32_put_byte(p, seg->data[off + i]);
+			}
+
+			/* OH GOD THE INDENTATION!!! */
+			for (; i < IFIBIN_DATA_LEN; i++) {
+				*p++ = ' ';
+				p = inhex32_put_byte(p, 0xFF);
+			}
 
-		for (i = 0; i < len; i++)
-			fprintf(out, " %02X", data[addr + i]);
+			*p++ = '\r';
+			*p++ = '\n';
 
-		/* OH GOD THE INDENTATION!!! */
-		if (len < IFIBIN_DATA_LEN) {
-			for (i = 0; i < IFIBIN_DATA_LEN - len; i++)
-				fprintf(out, " %02X", 0xFF);
+			if ((fill = inhex32_flush(out, buf, p - buf, 0)) == -1)
+				goto error;
+			p = buf + fill;
 		}
+	}
 
-		fprintf(out, "\r\n");
+	if (inhex32_flush(out, buf, p - buf, 1) == -1)
+		goto error;
+
+	if (fclose(out) != 0) {
+		rigel_error("writing %s: %s\n", fn, strerror(errno));
+		return -1;
 	}
-	fclose(out);
 
 	return 0;
+
+ error:
+	rigel_error("writing %s: %s\n", fn, strerror(errno));
+	fclose(out);
+	return -1;
 }
@@ -24,6 +24,7 @@
 #define _INHEX32_H
 
 #include "rigel-defs.h"
+#include "image.h"
 #include <sys/types.h>
 
 #define INHEX_MAX_DATA 0x10
@@ -63,23 +64,45 @@ enum ProgramAddressMode {
 typedef enum {
     IntelHexFormat,
     InnovationFirstFormat,
-    BinaryDataFormat
+    BinaryDataFormat,
+    RigelImageFormat
 } program_format_t;
 
+/* Readers add the data in a file to an image (see image.h), and return
+ * -1 on failure. */
 typedef int (*FormatReadFunc)(const char *,
-                              void *,
-                              size_t,
-                              uint32_t *,
-                              uint32_t *);
+                              struct image *);
 
-int inhex32_write(const char *fn, void *mem, uint32_t start, uint32_t end);
-int inhex32_read (const char *fn, void *mem, size_t memsize, 
-                  uint32_t *start, uint32_t *end);
+/* Map the file fn read-only into memory, storing its size in length.
+ * Returns NULL (after reporting why) on failure. The readers below parse
+ * from the mapping in a single pass rather than through stdio. */
+const char *inhex32_map(const char *fn, size_t *length);
+void inhex32_unmap(const char *data, size_t length);
+
+/* Writers write out only the populated segments of an image. */
+int inhex32_write(const char *fn, const struct image *img);
+int inhex32_read (const char *fn, struct image *img);
 
 int inhex32_validate(const char *fn);
 
-int ifi_bin_write(const char *fn, void *pmem, uint32_t start, uint32_t end);
-int ifi_bin_read (const char *fn, void *buffer, size_t bufsize, 
-                  uint32_t *start, uint32_t *end);
+/* Called by inhex32_stream with each complete row (BYTES_PER_ROW bytes
+ * at a row-aligned address); returns -1 to stop parsing. */
+typedef int (*InhexRowFunc)(uint32_t address,
+                            const uint8_t *row,
+                            void *arg);
+
+/* Parse fn ("-" for standard input) into the flat buffer mem (indexed by
+ * address, with configuration data past memsize ignored), handing
+ * each row to emit as soon as the file moves past it, so it can be used
+ * while the rest of the file is still being read. A row that a later
+ * record comes back to is emitted again. */
+int inhex32_stream(const char *fn, void *mem, size_t memsize,
+                   InhexRowFunc emit, void *arg);
+
+/* When set, ifi_bin_read reports each line it reads on stderr. */
+extern int ifi_bin_verbose;
+
+int ifi_bin_write(const char *fn, const struct image *img);
+int ifi_bin_read (const char *fn, struct image *img);
 
 #endif
@@ -0,0 +1,188 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "planner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Operations allocated for a new plan; doubled whenever it fills up */
+#define PLAN_INITIAL_SIZE 64
+
+/* Whether a row is to be erased and rewritten */
+#define PLAN_DIRTY(dirty, row) (!(dirty) || (dirty)[row])
+
+/* Whether a clean row may be erased along with the dirty rows around it */
+#define PLAN_ERASABLE(erasable, row) (!(erasable) || (erasable)[row])
+
+static int
+plan_add(struct plan *plan, enum PlanOperation op,
+         uint32_t address, uint8_t count)
+{
+    struct plan_op *ops;
+
+    if(plan->nops == plan->size) {
+        if(!(ops = (struct plan_op *)realloc(plan->ops, 2 * plan->size *
+                                             sizeof(struct plan_op))))
+            return -1;
+        plan->ops = ops;
+        plan->size *= 2;
+    }
+
+    plan->ops[plan->nops].op      = op;
+    plan->ops[plan->nops].address = address;
+    plan->ops[plan->nops].count   = count;
+    plan->nops++;
+
+    if(op == PlanEraseRows)
+        plan->rows += count;
+    else plan->blocks += count;
+
+    return 0;
+}
+
+static int
+plan_blank(const uint8_t *mem, uint32_t address, uint32_t length,
+           uint8_t erased)
+{
+    while(length--)
+        if(mem[address++] != erased)
+            return 0;
+    return 1;
+}
+
+/* Plan the write packets for the block-aligned region between from and
+ * to. If skip is set, the region has just been erased and blocks holding
+ * the erased value need not be written. */
+static int
+plan_writes(struct plan *plan, const uint8_t *mem, uint32_t from,
+            uint32_t to, int skip, uint8_t erased, uint8_t max_blocks)
+{
+    uint32_t addr, p, gap, limit;
+    int row_aligned = (max_blocks * BYTES_PER_BLOCK) % BYTES_PER_ROW == 0;
+
+    for(addr = from; addr < to; addr = p) {
+        if(skip && plan_blank(mem, addr, BYTES_PER_BLOCK, erased)) {
+            p = addr + BYTES_PER_BLOCK;
+            continue;
+        }
+
+        /* Fill the packet, stopping at a long enough gap and leaving
+         * the gap itself out. */
+        limit = min(to, addr + max_blocks * BYTES_PER_BLOCK);
+        for(p = addr, gap = 0;
+            p < limit && gap < PLAN_BLANK_GAP * BYTES_PER_BLOCK;
+            p += BYTES_PER_BLOCK)
+            gap = (skip && plan_blank(mem, p, BYTES_PER_BLOCK, erased)) ?
+                  gap + BYTES_PER_BLOCK : 0;
+        p -= gap;
+
+        /* When packets hold whole rows, a full packet ends on a row
+         * boundary so that the rest of the region is written in whole
+         * rows. Otherwise packing them full saves more. */
+        if(p == limit && p < to && p % BYTES_PER_ROW && row_aligned &&
+           p - (p % BYTES_PER_ROW) > addr)
+            p -= p % BYTES_PER_ROW;
+
+        if(plan_add(plan, PlanWriteBlocks, addr,
+                    (p - addr) / BYTES_PER_BLOCK) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+struct plan *
+plan_build(const uint8_t *mem, uint32_t start, uint32_t end,
+           const uint8_t *dirty, const uint8_t *erasable,
+           uint32_t erase_low, uint8_t erased, uint8_t max_blocks)
+{
+    struct plan *plan;
+    uint32_t row, run, last, r, n, rowend;
+
+    if(!(plan = (struct plan *)calloc(1, sizeof(struct plan))))
+        return NULL;
+    if(!(plan->ops = (struct plan_op *)malloc(PLAN_INITIAL_SIZE *
+                                              sizeof(struct plan_op)))) {
+        free(plan);
+        return NULL;
+    }
+    plan->size = PLAN_INITIAL_SIZE;
+
+    if(max_blocks == 0)
+        max_blocks = 1;
+
+    start -= start % BYTES_PER_BLOCK;
+    end   -= end % BYTES_PER_BLOCK;
+
+    /* The boot block can't be erased, so whatever lies there is
+     * written in place. */
+    if(start < erase_low &&
+       plan_writes(plan, mem, start, min(end, erase_low), 0,
+                   erased, max_blocks) == -1)
+        goto error;
+
+    last = (end + BYTES_PER_ROW - 1) / BYTES_PER_ROW;
+    for(row = max(start, erase_low) / BYTES_PER_ROW; row < last; row = run) {
+        if(!PLAN_DIRTY(dirty, row)) {
+            run = row + 1;
+            continue;
+        }
+
+        /* Extend the run over the dirty rows that follow, and over any
+         * clean rows that may be erased and hold nothing but erased
+         * bytes if there are more dirty rows after them; erasing those
+         * costs nothing. */
+        for(run = row + 1; run < last; run = r + 1) {
+            for(r = run; r < last && !PLAN_DIRTY(dirty, r); r++) {
+                rowend = min(end, (r + 1) * BYTES_PER_ROW);
+                if(!PLAN_ERASABLE(erasable, r) ||
+                   !plan_blank(mem, r * BYTES_PER_ROW,
+                               rowend - r * BYTES_PER_ROW, erased))
+                    break;
+            }
+            if(r == last || !PLAN_DIRTY(dirty, r))
+                break;
+        }
+
+        for(r = row; r < run; r += n) {
+            n = min(run - r, PLAN_MAX_ERASE);
+            if(plan_add(plan, PlanEraseRows, r * BYTES_PER_ROW, n) == -1)
+                goto error;
+        }
+
+        if(plan_writes(plan, mem, max(start, row * BYTES_PER_ROW),
+                       min(end, run * BYTES_PER_ROW), 1,
+                       erased, max_blocks) == -1)
+            goto error;
+    }
+
+    return plan;
+
+error:
+    plan_free(plan);
+    return NULL;
+}
+
+void
+plan_free(struct plan *plan)
+{
+    if(plan) {
+        free(plan->ops);
+        free(plan);
+    }
+}
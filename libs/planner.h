@@ -0,0 +1,83 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/* librigel API for planning the erase and write operations needed to load
+ * a program image into flash memory in as few AN851 packets as possible. */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _PLANNER_H
+#define _PLANNER_H
+
+#include "pic18.h"
+#include "rigel-defs.h"
+
+#include <sys/types.h>
+
+/* Most rows a single ER_FLASH (or IFI_WR_ROW) request can erase */
+#define PLAN_MAX_ERASE 0xFF
+
+/* Gaps of at least this many erased blocks inside the image are skipped.
+ * A shorter gap costs less to send than the framing, acknowledgement and
+ * turnaround of starting another packet after it. */
+#define PLAN_BLANK_GAP 4
+
+enum PlanOperation {
+    PlanEraseRows,
+    PlanWriteBlocks
+};
+
+struct plan_op {
+    enum PlanOperation op;
+    uint32_t address;
+    uint8_t  count;    /* Rows to erase, or blocks to write */
+};
+
+struct plan {
+    struct plan_op *ops;
+    uint32_t nops, size;
+
+    /* Totals over every operation in the plan */
+    uint32_t rows, blocks;
+};
+
+/* Plan loading the image mem (indexed by address) between start and end.
+ *
+ * dirty is a row map as filled in by device_diff_flash; only the rows
+ * marked in it are erased and rewritten. If dirty is NULL, every row
+ * is. Rows below erase_low (the boot block) are written but never erased.
+ *
+ * Adjacent erases are merged into runs of up to PLAN_MAX_ERASE rows,
+ * absorbing clean rows in between that hold nothing but erased bytes and
+ * are marked in erasable, the rows whose contents on the device don't
+ * matter or are known to be blank already. If erasable is NULL, any row
+ * may be, as when the whole span is being loaded afresh.
+ * Write packets hold up to max_blocks blocks; if that is a whole number
+ * of rows, they end on a row boundary unless the data ends first. Blocks
+ * of erased rows that already hold the erased value are left out.
+ *
+ * Returns a plan to be freed with plan_free, or NULL on failure. */
+struct plan *plan_build(const uint8_t *mem,
+                        uint32_t start,
+                        uint32_t end,
+                        const uint8_t *dirty,
+                        const uint8_t *erasable,
+                        uint32_t erase_low,
+                        uint8_t erased,
+                        uint8_t max_blocks);
+
+void plan_free(struct plan *plan);
+
+#endif /* _PLANNER_H */
@@ -0,0 +1,313 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "rimage.h"
+#include "inhex32.h"
+#include "pic18.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define RIMAGE_ALIGN(x) (((x) + 3) & ~3U)
+
+/* Rows of flash a segment covers, each with a CRC */
+#define RIMAGE_ROWS(address, length) \
+     (((address) + (length) - 1) / BYTES_PER_ROW - \
+      (address) / BYTES_PER_ROW + 1)
+
+/* CRC-32 (the polynomial of zlib and PNG, reflected) of every byte */
+static const uint32_t crc_table[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+    0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+    0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+    0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+    0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+    0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+    0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+    0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+    0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+    0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+    0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+    0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+    0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+    0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+    0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+    0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+    0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+uint32_t
+rimage_crc(uint32_t crc, const void *udata, uint32_t length)
+{
+    const uint8_t *data = (const uint8_t *)udata;
+
+    crc ^= 0xFFFFFFFF;
+    while(length--)
+        crc = crc_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+static enum RimageSection
+rimage_section(uint32_t address)
+{
+    if(address >= RIMAGE_EEPROM_BASE)
+        return RimageEeprom;
+    if(address >= RIMAGE_CONFIG_BASE)
+        return RimageConfig;
+    return RimageFlash;
+}
+
+/* Check the header of a mapped file; returns a description of what is
+ * wrong with it, or NULL. */
+static const char *
+rimage_check_header(const uint8_t *map, size_t length)
+{
+    uint32_t nsegs;
+
+    if(length < RIMAGE_HEADER_SIZE || memcmp(map, RIMAGE_MAGIC, 4) != 0)
+        return "not a rigel image";
+    if(get16(map + 4) != RIMAGE_VERSION)
+        return "unsupported version";
+    if(get32(map + 28) != rimage_crc(0, map, 28))
+        return "header CRC mismatch";
+    if(get32(map + 16) != length)
+        return "truncated file";
+
+    nsegs = get32(map + 8);
+    if(nsegs > (length - RIMAGE_HEADER_SIZE) / RIMAGE_ENTRY_SIZE)
+        return "segment table runs past the end of the file";
+    if(get32(map + 20) != rimage_crc(0, map + RIMAGE_HEADER_SIZE,
+                                        nsegs * RIMAGE_ENTRY_SIZE))
+        return "segment table CRC mismatch";
+
+    return NULL;
+}
+
+int
+rimage_device_id(const char *fn, uint16_t *device_id)
+{
+    const char *map;
+    size_t length;
+    int ret = -1;
+
+    if(!(map = inhex32_map(fn, &length)))
+        return -1;
+
+    if(!rimage_check_header((const uint8_t *)map, length)) {
+        *device_id = get16((const uint8_t *)map + 6);
+        ret = 0;
+    }
+
+    inhex32_unmap(map, length);
+    return ret;
+}
+
+int
+rimage_read(const char *fn, struct image *img)
+{
+    const char *umap, *what;
+    const uint8_t *map, *entry, *data, *crcs;
+    size_t length;
+    uint32_t i, r, nsegs, address, seglen, offset, next = 0;
+    uint32_t from, to;
+    int ret = -1;
+
+    if(!(umap = inhex32_map(fn, &length)))
+        return -1;
+    map = (const uint8_t *)umap;
+
+    if((what = rimage_check_header(map, length)))
+        goto error;
+
+    img->fill = map[12];
+    nsegs = get32(map + 8);
+    for(i = 0; i < nsegs; i++) {
+        entry   = map + RIMAGE_HEADER_SIZE + i * RIMAGE_ENTRY_SIZE;
+        address = get32(entry + 4);
+        seglen  = get32(entry + 8);
+        offset  = get32(entry + 12);
+
+        what = "bad segment";
+        if(seglen == 0 || entry[0] != rimage_section(address) ||
+           (i > 0 && address < next) || address + seglen < address)
+            goto error;
+        next = address + seglen;
+
+        what = "segment runs past the end of the file";
+        if(offset > length || seglen > length - offset ||
+           RIMAGE_ALIGN(offset + seglen) +
+           4 * RIMAGE_ROWS(address, seglen) > length)
+            goto error;
+
+        data = map + offset;
+        crcs = map + RIMAGE_ALIGN(offset + seglen);
+        for(r = 0; r < RIMAGE_ROWS(address, seglen); r++) {
+            from = max(address, (address / BYTES_PER_ROW + r) *
+                       BYTES_PER_ROW);
+            to   = min(next, (address / BYTES_PER_ROW + r + 1) *
+                       BYTES_PER_ROW);
+            if(get32(crcs + 4 * r) != rimage_crc(0, data + (from - address),
+                                                 to - from)) {
+                rigel_error("%s: CRC mismatch in row %06Xh!\n", fn, from);
+                goto out;
+            }
+        }
+
+        if(image_put(img, address, data, seglen) == -1) {
+            rigel_error("out of memory!\n");
+            goto out;
+        }
+    }
+    ret = 0;
+    goto out;
+
+error:
+    rigel_error("reading rigel image %s: %s!\n", fn, what);
+out:
+    inhex32_unmap(umap, length);
+    return ret;
+}
+
+int
+rimage_write(const char *fn, const struct image *img, uint16_t device_id)
+{
+    FILE *out;
+    uint8_t header[RIMAGE_HEADER_SIZE], *table, crc[4];
+    static const uint8_t pad[4];
+    const struct image_segment *seg;
+    uint32_t i, r, offset, rows, from, to;
+    int ok;
+
+    if(!(table = (uint8_t *)calloc(img->nsegs + 1, RIMAGE_ENTRY_SIZE))) {
+        rigel_error("out of memory!\n");
+        return -1;
+    }
+
+    /* Lay out each segment's data and row CRCs after the table */
+    offset = RIMAGE_HEADER_SIZE + img->nsegs * RIMAGE_ENTRY_SIZE;
+    for(i = 0; i < img->nsegs; i++) {
+        seg = &img->segs[i];
+        table[i * RIMAGE_ENTRY_SIZE] = rimage_section(seg->address);
+        put32(table + i * RIMAGE_ENTRY_SIZE + 4, seg->address);
+        put32(table + i * RIMAGE_ENTRY_SIZE + 8, seg->length);
+        put32(table + i * RIMAGE_ENTRY_SIZE + 12, offset);
+
+        offset = RIMAGE_ALIGN(offset + seg->length) +
+                 4 * RIMAGE_ROWS(seg->address, seg->length);
+    }
+
+    memset(header, 0, RIMAGE_HEADER_SIZE);
+    memcpy(header, RIMAGE_MAGIC, 4);
+    put16(header + 4, RIMAGE_VERSION);
+    put16(header + 6, device_id);
+    put32(header + 8, img->nsegs);
+    header[12] = img->fill;
+    put32(header + 16, offset);
+    put32(header + 20, rimage_crc(0, table, img->nsegs * RIMAGE_ENTRY_SIZE));
+    put32(header + 28, rimage_crc(0, header, 28));
+
+    if(!(out = fopen(fn, "wb"))) {
+        rigel_error("creating rigel image %s!\n", fn);
+        free(table);
+        return -1;
+    }
+
+    ok = fwrite(header, 1, RIMAGE_HEADER_SIZE, out) == RIMAGE_HEADER_SIZE &&
+         fwrite(table, RIMAGE_ENTRY_SIZE, img->nsegs, out) == img->nsegs;
+
+    for(i = 0; ok && i < img->nsegs; i++) {
+        seg  = &img->segs[i];
+        rows = RIMAGE_ROWS(seg->address, seg->length);
+        ok = fwrite(seg->data, 1, seg->length, out) == seg->length &&
+             fwrite(pad, 1, RIMAGE_ALIGN(seg->length) - seg->length,
+                    out) == RIMAGE_ALIGN(seg->length) - seg->length;
+
+        for(r = 0; ok && r < rows; r++) {
+            from = max(seg->address, (seg->address / BYTES_PER_ROW + r) *
+                       BYTES_PER_ROW);
+            to   = min(seg->address + seg->length,
+                       (seg->address / BYTES_PER_ROW + r + 1) *
+                       BYTES_PER_ROW);
+            put32(crc, rimage_crc(0, seg->data + (from - seg->address),
+                                  to - from));
+            ok = fwrite(crc, 1, 4, out) == 4;
+        }
+    }
+    free(table);
+
+    if(fclose(out) != 0 || !ok) {
+        rigel_error("writing rigel image %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/* librigel API for reading and writing rigel's native binary program
+ * image format (.rimg), which carries a segment map and CRCs and can be
+ * loaded without any text parsing. */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _RIMAGE_H
+#define _RIMAGE_H
+
+#include "image.h"
+
+/* Layout of a .rimg file; every field is little-endian.
+ *
+ * Header (RIMAGE_HEADER_SIZE bytes):
+ *   0  magic "RIMG"
+ *   4  u16 version (RIMAGE_VERSION)
+ *   6  u16 device ID the image was built or read for, or 0 for any
+ *   8  u32 number of segments
+ *  12  u8  fill value of the addresses outside the segments, 3 reserved
+ *  16  u32 size of the whole file
+ *  20  u32 CRC-32 of the segment table
+ *  24  u32 reserved (0)
+ *  28  u32 CRC-32 of bytes 0 to 27
+ *
+ * Segment table (RIMAGE_ENTRY_SIZE bytes per segment, in address order):
+ *   0  u8  section (enum RimageSection), 3 reserved
+ *   4  u32 address
+ *   8  u32 length
+ *  12  u32 file offset of the data
+ *
+ * Each segment's data is followed (at the next multiple of 4 bytes) by a
+ * u32 CRC-32 for every flash row it covers, taken over the part of the
+ * row inside the segment, so a corrupt file is pinned down to the row. */
+#define RIMAGE_MAGIC       "RIMG"
+#define RIMAGE_VERSION     1
+#define RIMAGE_HEADER_SIZE 32
+#define RIMAGE_ENTRY_SIZE  16
+
+/* Sections follow the addresses Microchip tools give them in HEX files */
+#define RIMAGE_CONFIG_BASE 0x300000
+#define RIMAGE_EEPROM_BASE 0xF00000
+
+enum RimageSection {
+    RimageFlash,
+    RimageConfig,
+    RimageEeprom
+};
+
+/* Read a .rimg file into img, checking every CRC. */
+int rimage_read(const char *fn, struct image *img);
+
+/* Write img to fn as a .rimg file, marked for the device device_id (or
+ * 0 for any). */
+int rimage_write(const char *fn, const struct image *img, uint16_t device_id);
+
+/* CRC-32 (IEEE 802.3, as used by zlib) of length bytes of data. crc is 0
+ * to start with, or the CRC of the data before, to carry on from. */
+uint32_t rimage_crc(uint32_t crc, const void *data, uint32_t length);
+
+/* Read just the device ID from the header of a .rimg file. Returns -1
+ * if it is not one. */
+int rimage_device_id(const char *fn, uint16_t *device_id);
+
+#endif /* _RIMAGE_H */
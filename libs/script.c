@@ -0,0 +1,361 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "script.h"
+#include "an851.h"
+#include "inhex32.h"
+#include "rimage.h"
+#include "planner.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCRIPT_ALIGN(x) (((x) + 3) & ~3U)
+
+/* Most space a frame and its record take up in a script */
+#define SCRIPT_FRAME_MAX \
+     (SCRIPT_RECORD_SIZE + SCRIPT_ALIGN(AN851_FRAME_SIZE(MAX_DATA_LENGTH)))
+
+static uint16_t
+get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+/* CRC of a whole script, leaving out the field that holds it */
+static uint32_t
+script_crc(const uint8_t *map, uint32_t length)
+{
+    return rimage_crc(rimage_crc(0, map, 28), map + SCRIPT_HEADER_SIZE,
+                      length - SCRIPT_HEADER_SIZE);
+}
+
+/* Build the request for one operation of a plan into tx, the same way
+ * an851_er_flash, ifi_wr_row and an851_wr_flash do. */
+static void
+script_request(const struct plan_op *op, const uint8_t *mem, int ifi,
+               struct an851_packet *tx)
+{
+    tx->data[0] = op->count;
+    tx->data[1] = op->address & 0xFF;
+    tx->data[2] = (op->address >> 8) & 0xFF;
+    tx->data[3] = (op->address >> 16) & 0xFF;
+    tx->request_length = op->count;
+
+    if(op->op == PlanWriteBlocks) {
+        tx->command = WR_FLASH;
+        tx->request_length = op->count * BYTES_PER_BLOCK;
+        tx->length = tx->request_length + 4;
+        memcpy(tx->data + 4, mem + op->address, tx->request_length);
+    } else if(ifi) {
+        tx->command = IFI_WR_ROW;
+        tx->data[4] = 0x00;
+        tx->length = 5;
+    } else {
+        tx->command = ER_FLASH;
+        tx->length = 4;
+    }
+}
+
+int
+script_compile(const char *fn, const struct device *dev,
+               const struct image *img, uint8_t packet_size)
+{
+    FILE *out;
+    struct plan *plan;
+    struct an851_packet tx;
+    const struct plan_op *op;
+    uint8_t *mem, *buf, *p;
+    uint32_t i, end = 0, size;
+    int len, ret = -1;
+
+    if(packet_size < BYTES_PER_BLOCK || packet_size > DEVICE_MAX_WRITE) {
+        rigel_error("invalid packet size %d for a flash script!\n",
+                    packet_size);
+        return -1;
+    }
+
+    if(!(plan = device_plan_program(dev, img,
+                                    packet_size / BYTES_PER_BLOCK, &mem)))
+        return -1;
+    if(!(buf = (uint8_t *)calloc(1, SCRIPT_HEADER_SIZE +
+                                 plan->nops * SCRIPT_FRAME_MAX))) {
+        rigel_error("out of memory!\n");
+        goto out;
+    }
+
+    p = buf + SCRIPT_HEADER_SIZE;
+    for(i = 0; i < plan->nops; i++) {
+        op = &plan->ops[i];
+        script_request(op, mem, dev->is_ifi, &tx);
+        len = an851_encode(tx.command, tx.data, tx.length,
+                           p + SCRIPT_RECORD_SIZE);
+
+        p[0] = tx.command;
+        p[1] = tx.length;
+        p[2] = tx.request_length;
+        p[3] = tx.command;
+        put32(p + 4, op->address);
+        put16(p + 8, len);
+        p += SCRIPT_RECORD_SIZE + SCRIPT_ALIGN(len);
+
+        end = max(end, op->address + op->count *
+                  (op->op == PlanWriteBlocks ? BYTES_PER_BLOCK
+                                             : BYTES_PER_ROW));
+    }
+    size = p - buf;
+
+    memcpy(buf, SCRIPT_MAGIC, 4);
+    put16(buf + 4, SCRIPT_VERSION);
+    put16(buf + 6, dev->dev_id);
+    put32(buf + 8, plan->nops);
+    put32(buf + 12, dev->mem.flash_low);
+    put32(buf + 16, end);
+    buf[20] = dev->is_ifi ? 1 : 0;
+    buf[21] = packet_size;
+    put32(buf + 24, size);
+    put32(buf + 28, script_crc(buf, size));
+
+    if(!(out = fopen(fn, "wb"))) {
+        rigel_error("creating flash script %s!\n", fn);
+        goto out;
+    }
+    if(fwrite(buf, 1, size, out) != size || fclose(out) != 0)
+        rigel_error("writing flash script %s!\n", fn);
+    else ret = 0;
+
+out:
+    free(buf);
+    free(mem);
+    plan_free(plan);
+    return ret;
+}
+
+/* Unframe the frame of a record into pkt. Returns -1 unless it holds
+ * exactly one whole frame. */
+static int
+script_decode(const uint8_t *frame, int length, struct an851_packet *pkt)
+{
+    int i, ret = AN851_RX_MORE;
+    struct an851_decoder dec;
+
+    an851_decoder_init(&dec, pkt);
+    for(i = 0; i < length; i++)
+        if((ret = an851_decoder_feed(&dec, frame[i])) != AN851_RX_MORE)
+            break;
+
+    return (ret == AN851_RX_FRAME && i == length - 1) ? 0 : -1;
+}
+
+struct flash_script *
+script_open(const char *fn)
+{
+    struct flash_script *script;
+    const char *map, *what = "not a flash script";
+    const uint8_t *p, *end;
+    uint32_t i, len;
+    struct an851_packet pkt;
+
+    if(!(script = (struct flash_script *)calloc(1,
+                                                sizeof(struct flash_script)))) {
+        rigel_error("out of memory!\n");
+        return NULL;
+    }
+    if(!(map = inhex32_map(fn, &script->length))) {
+        free(script);
+        return NULL;
+    }
+    script->map = p = (const uint8_t *)map;
+    end = p + script->length;
+
+    if(script->length < SCRIPT_HEADER_SIZE ||
+       memcmp(p, SCRIPT_MAGIC, 4) != 0)
+        goto error;
+    what = "unsupported version";
+    if(get16(p + 4) != SCRIPT_VERSION)
+        goto error;
+    what = "truncated file";
+    if(get32(p + 24) != script->length)
+        goto error;
+    what = "CRC mismatch";
+    if(get32(p + 28) != script_crc(p, script->length))
+        goto error;
+
+    script->device_id   = get16(p + 6);
+    script->nframes     = get32(p + 8);
+    script->erase_low   = get32(p + 12);
+    script->end         = get32(p + 16);
+    script->ifi         = p[20];
+    script->packet_size = p[21];
+
+    /* Walk the frames once, so running the script needn't check them,
+     * and take the CRC of what each write writes, for checking against
+     * the acknowledgements of a bootloader that sends them. */
+    what = "bad frame";
+    if(script->nframes > script->length / SCRIPT_RECORD_SIZE)
+        goto error;
+    if(!(script->crcs = (uint32_t *)calloc(script->nframes + 1,
+                                           sizeof(uint32_t)))) {
+        what = "out of memory";
+        goto error;
+    }
+    p += SCRIPT_HEADER_SIZE;
+    for(i = 0; i < script->nframes; i++) {
+        if(end - p < SCRIPT_RECORD_SIZE)
+            goto error;
+        len = get16(p + 8);
+        if(len > AN851_FRAME_SIZE(MAX_DATA_LENGTH) ||
+           end - p - SCRIPT_RECORD_SIZE < SCRIPT_ALIGN(len) ||
+           (p[0] != WR_FLASH &&
+            p[0] != (script->ifi ? IFI_WR_ROW : ER_FLASH)))
+            goto error;
+        if(p[0] == WR_FLASH) {
+            if(script_decode(p + SCRIPT_RECORD_SIZE, len, &pkt) == -1 ||
+               pkt.length < 4)
+                goto error;
+            script->crcs[i] = rimage_crc(0, pkt.data + 4, pkt.length - 4);
+        }
+        p += SCRIPT_RECORD_SIZE + SCRIPT_ALIGN(len);
+    }
+    if(p != end)
+        goto error;
+
+    return script;
+
+error:
+    rigel_error("reading flash script %s: %s!\n", fn, what);
+    script_close(script);
+    return NULL;
+}
+
+void
+script_close(struct flash_script *script)
+{
+    if(script) {
+        inhex32_unmap((const char *)script->map, script->length);
+        free(script->crcs);
+        free(script);
+    }
+}
+
+/* Read back the blocks a WR_FLASH frame wrote and compare them with the
+ * data in the frame. */
+static int
+script_verify(const struct device *dev, const uint8_t *frame, int length,
+              uint32_t address)
+{
+    struct an851_packet pkt;
+    uint8_t buffer[DEVICE_BUFFER_SIZE];
+
+    if(script_decode(frame, length, &pkt) == -1 || pkt.length < 4 ||
+       an851_rd_flash(dev->session, address, pkt.length - 4,
+                      buffer) == -1 ||
+       memcmp(pkt.data + 4, buffer, pkt.length - 4) != 0) {
+        rigel_error("verifying flash write, address %06Xh!\n", address);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+script_run(struct device *dev, const struct flash_script *script)
+{
+    int retries;
+    uint32_t i, address;
+    uint16_t length;
+    const uint8_t *p = script->map + SCRIPT_HEADER_SIZE;
+    struct an851_packet tx;
+
+    if(!dev->state.connected)
+        return -1;
+
+    /* A script is only good for the kind of device it was made for */
+    if(script->device_id && script->device_id != dev->dev_id) {
+        rigel_error("flash script was compiled for device %04Xh, "
+                    "not %04Xh (%s)!\n", script->device_id, dev->dev_id,
+                    dev->dev_name);
+        return -1;
+    }
+    if(script->ifi != (dev->is_ifi ? 1 : 0) ||
+       script->erase_low != dev->mem.flash_low) {
+        rigel_error("flash script was compiled for a %s device with a "
+                    "%d byte boot block!\n",
+                    script->ifi ? "IFI" : "non-IFI", script->erase_low);
+        return -1;
+    }
+    if(script->end > dev->mem.flash_high + 1) {
+        rigel_error("program will not fit on device!\n");
+        return -1;
+    }
+
+    for(i = 0; i < script->nframes; i++) {
+        tx.command        = p[0];
+        tx.length         = p[1];
+        tx.request_length = p[2];
+        address = get32(p + 4);
+        length  = get16(p + 8);
+
+        if((retries = an851_tx_frame(dev->session, &tx,
+                                     p + SCRIPT_RECORD_SIZE, length,
+                                     p[3], script->crcs[i])) == -1) {
+            rigel_error("%s at %06Xh failed!\n",
+                        an851_command_name(tx.command), address);
+            return -1;
+        }
+        
+        /* Writes the bootloader has checked itself are only read back
+         * if it says they went wrong */
+        if(tx.command == WR_FLASH &&
+           (dev->session->write_check == AN851_CHECK_BAD ||
+            (dev->session->write_check == AN851_CHECK_NONE &&
+             device_check_write(dev, retries))) &&
+           script_verify(dev, p + SCRIPT_RECORD_SIZE, length,
+                         address) == -1)
+            return -1;
+
+        if(dev->update_func)
+            dev->update_func(i + 1, script->nframes);
+
+        p += SCRIPT_RECORD_SIZE + SCRIPT_ALIGN(length);
+    }
+
+    return 0;
+}
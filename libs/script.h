@@ -0,0 +1,93 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/* librigel API for flash scripts: the AN851 requests that load a program
+ * image, framed ahead of time, so that loading the same program onto
+ * device after device only has to send them. */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _SCRIPT_H
+#define _SCRIPT_H
+
+#include "device.h"
+#include "image.h"
+
+/* Layout of a flash script; every field is little-endian.
+ *
+ * Header (SCRIPT_HEADER_SIZE bytes):
+ *   0  magic "RFSC"
+ *   4  u16 version (SCRIPT_VERSION)
+ *   6  u16 device ID it was compiled for, or 0 for any
+ *   8  u32 number of frames
+ *  12  u32 start of flash that can be erased (the end of the boot block)
+ *  16  u32 end of the flash addresses the frames touch
+ *  20  u8  1 if rows are erased with IFI_WR_ROW, 0 for ER_FLASH
+ *  21  u8  most data bytes written by a frame; 2 reserved
+ *  24  u32 size of the whole file
+ *  28  u32 CRC-32 of the whole file but this field
+ *
+ * Then for each frame, in the order they are sent, a SCRIPT_RECORD_SIZE
+ * byte record followed by the frame itself, framed and escaped exactly as
+ * an851_encode does, and padded to a multiple of 4 bytes:
+ *   0  u8  command
+ *   1  u8  length of the data after the command (unescaped)
+ *   2  u8  request_length (what the response time scales with)
+ *   3  u8  command expected back in the acknowledgement
+ *   4  u32 address
+ *   8  u16 length of the frame
+ *  10  u16 reserved */
+#define SCRIPT_MAGIC       "RFSC"
+#define SCRIPT_VERSION     1
+#define SCRIPT_HEADER_SIZE 32
+#define SCRIPT_RECORD_SIZE 12
+
+/* A flash script mapped into memory by script_open. It is only read
+ * from, so one script may be run on any number of devices at once. */
+struct flash_script {
+    const uint8_t *map;
+    size_t length;
+
+    uint16_t device_id;
+    uint32_t nframes;
+    uint32_t erase_low, end;
+    uint8_t ifi, packet_size;
+    uint32_t *crcs; /* CRC-32 of the data each WR_FLASH frame writes */
+};
+
+/* Compile the plan for loading img onto dev (see device_plan_program)
+ * into a flash script at fn, with writes of up to packet_size bytes.
+ * dev need not be connected; only its device ID, memory layout and
+ * is_ifi are used, and a device ID of 0 lets the script run on any
+ * device with the same boot block and erase command. */
+int script_compile(const char *fn,
+                   const struct device *dev,
+                   const struct image *img,
+                   uint8_t packet_size);
+
+/* Map a flash script and check it over. Returns NULL (after reporting
+ * why) if it can't be used. Free with script_close. */
+struct flash_script *script_open(const char *fn);
+void script_close(struct flash_script *script);
+
+/* Send every frame of script to the device, which must be the kind it
+ * was compiled for. Writes are verified one by one if verify_on_write is
+ * set (see device_check_write), unless the bootloader confirmed them in
+ * its acknowledgements (AN851_CAP_WRSUM), and progress is reported in
+ * frames. */
+int script_run(struct device *dev,
+               const struct flash_script *script);
+
+#endif /* _SCRIPT_H */
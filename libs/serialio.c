@@ -24,6 +24,7 @@
 #include <string.h>
 #include <errno.h>
 
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
@@ -31,9 +32,6 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-static struct timeval ttytimeout;    
-static fd_set ttyfds;
-
 /* TODO: Consider using setitimer for this function. */
 void
 waitus(long us)
@@ -67,35 +65,80 @@ sio_valid(int fd)
     return 0;
 }
 
+/* Fill in an absolute deadline ms milliseconds from now. Deadlines are
+ * taken from the monotonic clock, so setting the time of day while a
+ * transfer is in progress can't stretch or cut short a read. */
+void
+sio_deadline(struct timespec *deadline, int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    
+    deadline->tv_sec  += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+    if(deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* Milliseconds left before deadline, rounded up so that we never wake
+ * up just short of it; 0 if it has already passed. */
+static int
+sio_remaining(const struct timespec *deadline)
+{
+    int64_t ns;
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000 +
+                  (deadline->tv_nsec - now.tv_nsec);
+    
+    return (ns > 0) ? (int)((ns + 999999) / 1000000) : 0;
+}
+
+/* Read whatever is available on fd, waiting no later than deadline for
+ * the first byte to show up. Returns as soon as any data arrives; a NULL
+ * deadline waits forever. Returns 0 if the deadline passed. */
 int
-sio_read(int fd, void *buffer, word maxlen)
+sio_read_until(int fd, void *buffer, word maxlen,
+               const struct timespec *deadline)
 {
     int ret;
     ssize_t rx;
-
-    rx = 0;    
-    FD_ZERO(&ttyfds);
-    FD_SET(fd, &ttyfds);
+    struct pollfd pfd;
+    
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    
+    do {
+        ret = poll(&pfd, 1, deadline ? sio_remaining(deadline) : -1);
+    } while(ret == -1 && errno == EINTR);
     
-    waitus(5000);
-
-    /* I'd prefer poll(2) but it is not implemented on OS X */
-    ret = select(fd+1, &ttyfds, NULL, NULL, &ttytimeout);
     if(!ret) return 0;   /* Timeout */
-    else if(ret == -1) { /* Error (interrupted, bad fd) */
-        rigel_error("read select failed: %s\n", strerror(errno));
+    else if(ret == -1) { /* Error (bad fd, out of memory) */
+        rigel_error("read poll failed: %s\n", strerror(errno));
         return -1;
     }
+    if(pfd.revents & POLLNVAL)
+        return -1;
+    
+    rx = read(fd, buffer, maxlen);
+    if(rx == -1 && (errno == EAGAIN || errno == EINTR))
+        return 0;
     
-    if(FD_ISSET(fd, &ttyfds)) {
-        rx = read(fd, buffer, maxlen);
-        
-        //if(rx == -1) rigel_error("Cannot read from serial port! (%s)\n", strerror(errno));
-    }
-        
     return rx;
 }
 
+/* Read whatever is available on fd, waiting up to timeout ms for it. */
+int
+sio_read(int fd, void *buffer, word maxlen, int timeout)
+{
+    struct timespec deadline;
+    
+    sio_deadline(&deadline, timeout);
+    return sio_read_until(fd, buffer, maxlen, &deadline);
+}
+
 int
 sio_write(int fd, const void * data, word length)
 {
@@ -118,15 +161,6 @@ sio_write(int fd, const void * data, word length)
     return (int)len;
 }
 
-/* This function sets up a total timeout (in ms) for any device read, plus
- * 5ms grace time for our device to actually receive and process the data. */
-void
-sio_settimeout(int tout)
-{
-    ttytimeout.tv_sec  = tout / 1000;
-    ttytimeout.tv_usec = ((tout % 1000) * 1000);
-}
-
 int
 sio_open(const char *device)
 {    
@@ -159,8 +193,6 @@ sio_open(const char *device)
     tcflush(fd, TCIFLUSH);
     tcsetattr(fd, TCSANOW, &tty_opts);
     
-    sio_settimeout(0); /* Immediate initial timeout */
-    
     return fd;
 }
 
@@ -24,6 +24,8 @@
 
 #include "rigel-defs.h"
 
+#include <time.h>
+
 #if defined(linux) || defined(CYGWIN)
     #define DEFAULT_SERIAL_PORT "/dev/ttyS0"
 #elif defined(__APPLE__)
@@ -39,8 +41,10 @@ void waitus(long us);
 int sio_valid(int fd);
 int sio_open (const char *device);
 int sio_close(int fd);
-int sio_read (int fd, void *buffer, word maxlen);
+int sio_read (int fd, void *buffer, word maxlen, int timeout);
+int sio_read_until(int fd, void *buffer, word maxlen,
+                   const struct timespec *deadline);
 int sio_write(int fd, const void *data, word length);
-void sio_settimeout(int tout);
+void sio_deadline(struct timespec *deadline, int ms);
 
 #endif /* _SERIALIO_H */
@@ -0,0 +1,415 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/* Fleet mode: load one program onto any number of devices on separate
+ * serial ports at once, using a pool of worker threads. The program file
+ * is parsed once and shared (read-only) by every worker. */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "rigel.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <glob.h>
+#include <time.h>
+#include <pthread.h>
+
+/* How often the aggregated progress line is redrawn (us) */
+#define FLEET_REFRESH 200000
+
+typedef enum {
+    FLEET_WAITING = 0,
+    FLEET_CONNECTING,
+    FLEET_COMPARING,
+    FLEET_ERASING,
+    FLEET_LOADING,
+    FLEET_FINISHING,
+    FLEET_DONE,
+    FLEET_FAILED
+} fleet_state;
+
+struct fleet_port {
+    const char *port;
+    char dev_name[DEVICE_NAME_LEN];
+
+    fleet_state state;
+    uint32_t current, total; /* Progress through the current state */
+    const char *error;       /* What failed, if state == FLEET_FAILED */
+    double elapsed;          /* Seconds spent on this port */
+};
+
+struct fleet {
+    const rigel_t *options;
+    struct device **devlist;
+    int ndev;
+
+    struct image *prog;
+    struct flash_script *script;  /* Instead of prog, with --script */
+    uint32_t start, end;
+
+    struct fleet_port *ports;
+    int nports, next;
+
+    /* Bootloader statistics of every port, summed */
+    struct an851_stats stats[AN851_COMMAND_SLOTS];
+
+    /* Protects next, stats and the state/progress of every port */
+    pthread_mutex_t lock;
+};
+
+static struct fleet fleet;
+
+/* The port each worker thread is currently flashing, so that the device
+ * update callback (which is not told which device it is reporting on)
+ * can find it. */
+static pthread_key_t fleet_self;
+
+static void
+fleet_set_state(struct fleet_port *p, fleet_state state, const char *error)
+{
+    pthread_mutex_lock(&fleet.lock);
+    p->state = state;
+    p->current = 0;
+    p->total = 1;
+    if(error)
+        p->error = error;
+    pthread_mutex_unlock(&fleet.lock);
+}
+
+static void
+fleet_update(uint32_t current, uint32_t total)
+{
+    struct fleet_port *p = pthread_getspecific(fleet_self);
+
+    if(!p)
+        return;
+
+    pthread_mutex_lock(&fleet.lock);
+    p->current = current;
+    p->total = total ? total : 1;
+    pthread_mutex_unlock(&fleet.lock);
+}
+
+static double
+fleet_elapsed(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) +
+           (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* Connect to, erase, load and run (or reset) the device on one port.
+ * This is the same sequence main() goes through for a single device. */
+static void
+fleet_flash(struct fleet_port *p)
+{
+    int was_ifi = 0;
+    uint8_t *dirty;
+    struct device dev;
+    struct timespec start;
+    const rigel_t *options = fleet.options;
+    const char *error = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_setspecific(fleet_self, p);
+    memset(&dev, 0, sizeof(struct device));
+
+    fleet_set_state(p, FLEET_CONNECTING, NULL);
+    if(device_connect(p->port, &dev, fleet.devlist, fleet.ndev) == -1) {
+        fleet_set_state(p, FLEET_FAILED, "connect failed");
+        goto done;
+    }
+    strncpy(p->dev_name, dev.dev_name, DEVICE_NAME_LEN - 1);
+
+    if(options->noifi && dev.is_ifi) {
+        dev.is_ifi = 0;
+        was_ifi = 1;
+    } else if(options->ifi)
+        dev.is_ifi = was_ifi = 1;
+
+    dev.opts.verify_on_write = options->verify ? options->verify :
+        (options->master ? DEVICE_VERIFY_AFTER : DEVICE_VERIFY_NONE);
+    dev.opts.replicate = !options->noreplicate;
+    if(options->verify == DEVICE_VERIFY_SAMPLE)
+        device_set_sampling(&dev, options->sample,
+                            options->seed + (p - fleet.ports));
+    device_set_callback(&dev, fleet_update);
+
+    if(options->diff && !options->erase) {
+        fleet_set_state(p, FLEET_COMPARING, NULL);
+        if(!(dirty = (uint8_t *)malloc(DEVICE_ROWS(fleet.end))))
+            error = "out of memory";
+        else if(device_diff_flash(&dev, fleet.prog, dirty) == -1)
+            error = "compare failed";
+        else {
+            fleet_set_state(p, FLEET_LOADING, NULL);
+            if(device_load_rows(&dev, fleet.prog, dirty) == -1)
+                error = "load failed";
+        }
+        free(dirty);
+    } else {
+        if(options->erase) {
+            fleet_set_state(p, FLEET_ERASING, NULL);
+            if(rigel_erase_device(&dev) == -1)
+                error = "erase failed";
+        }
+
+        if(!error) {
+            fleet_set_state(p, FLEET_LOADING, NULL);
+            if(fleet.script ? script_run(&dev, fleet.script) == -1
+                            : device_load_program(&dev, fleet.prog) == -1)
+                error = "load failed";
+        }
+    }
+
+    fleet_set_state(p, FLEET_FINISHING, NULL);
+    if(!error && options->run) {
+        if(options->noifi)
+            dev.is_ifi = was_ifi;
+        device_run_program(&dev);
+    } else device_reset(&dev);
+
+    pthread_mutex_lock(&fleet.lock);
+    an851_add_stats(dev.session, fleet.stats);
+    pthread_mutex_unlock(&fleet.lock);
+
+    device_disconnect(&dev);
+    fleet_set_state(p, error ? FLEET_FAILED : FLEET_DONE, error);
+
+done:
+    pthread_mutex_lock(&fleet.lock);
+    p->elapsed = fleet_elapsed(&start);
+    pthread_mutex_unlock(&fleet.lock);
+}
+
+static void *
+fleet_worker(void *arg)
+{
+    int i;
+
+    for(;;) {
+        pthread_mutex_lock(&fleet.lock);
+        i = (fleet.next < fleet.nports) ? fleet.next++ : -1;
+        pthread_mutex_unlock(&fleet.lock);
+
+        if(i == -1)
+            break;
+
+        fleet_flash(&fleet.ports[i]);
+    }
+
+    return NULL;
+}
+
+/* Progress of one port through its whole run, out of 1. Erasing (or
+ * comparing) is quick next to loading, so it only gets a small share of
+ * the bar. */
+static float
+fleet_port_progress(const struct fleet_port *p)
+{
+    float pct = (float)p->current / p->total;
+
+    switch(p->state) {
+    case FLEET_COMPARING:
+    case FLEET_ERASING:   return 0.1 * pct;
+    case FLEET_LOADING:   return 0.1 + 0.85 * pct;
+    case FLEET_FINISHING: return 0.95;
+    case FLEET_DONE:
+    case FLEET_FAILED:    return 1.0;
+    default:              return 0.0;
+    }
+}
+
+/* Redraw the aggregated progress line; returns the number of ports
+ * still in progress. */
+static int
+fleet_progress(void)
+{
+    int i, done = 0, failed = 0;
+    float pct = 0;
+
+    pthread_mutex_lock(&fleet.lock);
+    for(i = 0; i < fleet.nports; i++) {
+        pct += fleet_port_progress(&fleet.ports[i]);
+
+        if(fleet.ports[i].state == FLEET_DONE)
+            done++;
+        else if(fleet.ports[i].state == FLEET_FAILED)
+            failed++;
+    }
+    pthread_mutex_unlock(&fleet.lock);
+
+    load_update((uint32_t)(pct * 1000), fleet.nports * 1000);
+
+    return fleet.nports - done - failed;
+}
+
+static void
+fleet_summary(void)
+{
+    int i, failed = 0;
+    const struct fleet_port *p;
+
+    printf("\nFleet summary:\n");
+    for(i = 0; i < fleet.nports; i++) {
+        p = &fleet.ports[i];
+        printf("  %-20s %-16s %-6s %6.1f s",
+               p->port, p->dev_name[0] ? p->dev_name : "-",
+               (p->state == FLEET_DONE) ? "OK" : "FAILED", p->elapsed);
+        if(p->state != FLEET_DONE) {
+            printf("  (%s)", p->error ? p->error : "not attempted");
+            failed++;
+        }
+        putchar('\n');
+    }
+    printf("%d of %d devices loaded successfully.\n\n",
+           fleet.nports - failed, fleet.nports);
+}
+
+/* Expand a comma-separated list of serial ports, each of which may be
+ * a glob(3) pattern (i.e., "/dev/ttyUSB*,/dev/ttyS0"), into g. */
+static int
+rigel_fleet_ports(const char *spec, glob_t *g)
+{
+    int flags = GLOB_NOCHECK;
+    char *list, *port, *save;
+
+    if(!(list = strdup(spec)))
+        return -1;
+
+    memset(g, 0, sizeof(glob_t));
+    for(port = strtok_r(list, ",", &save); port;
+        port = strtok_r(NULL, ",", &save)) {
+        if(glob(port, flags, NULL, g) != 0) {
+            rigel_error("Cannot expand serial port list %s\n", port);
+            free(list);
+            globfree(g);
+            return -1;
+        }
+        flags |= GLOB_APPEND;
+    }
+    free(list);
+
+    return g->gl_pathc;
+}
+
+/* Load options->file onto every port in options->fleet. Returns the number
+ * of devices that failed, or -1 if the fleet could not be started at all. */
+int
+rigel_fleet(const rigel_t *options, struct device **devlist, int ndev)
+{
+    int i, jobs, failed = 0;
+    glob_t ports;
+    pthread_t *workers;
+    struct device *largest = NULL;
+
+    if(rigel_fleet_ports(options->fleet, &ports) <= 0) {
+        rigel_error("No serial ports given for fleet mode!\n");
+        return -1;
+    }
+
+    /* We don't know which devices are out there until we connect, so
+     * map the program for the largest device we know of; anything that
+     * won't fit on a particular device is caught when loading it. */
+    for(i = 0; i < ndev; i++)
+        if(!largest || devlist[i]->mem.flash_high > largest->mem.flash_high)
+            largest = devlist[i];
+
+    memset(&fleet, 0, sizeof(struct fleet));
+    fleet.options = options;
+    fleet.devlist = devlist;
+    fleet.ndev = ndev;
+    fleet.nports = ports.gl_pathc;
+
+    if(options->script) {
+        if(!(fleet.script = script_open(options->file))) {
+            globfree(&ports);
+            return -1;
+        }
+    } else if(!largest ||
+              !(fleet.prog = rigel_program_alloc(largest, options->file,
+                                                 options->master ?
+                                                 InnovationFirstFormat :
+                                                 options->fmt,
+                                                 &fleet.start,
+                                                 &fleet.end))) {
+        rigel_error("mapping program file to memory!\n");
+        globfree(&ports);
+        return -1;
+    }
+
+    jobs = (options->jobs > 0) ? min(options->jobs, fleet.nports)
+                               : fleet.nports;
+
+    fleet.ports = (struct fleet_port *)calloc(fleet.nports,
+                                              sizeof(struct fleet_port));
+    workers = (pthread_t *)calloc(jobs, sizeof(pthread_t));
+    if(!fleet.ports || !workers) {
+        rigel_error("allocating memory for fleet mode!\n");
+        failed = -1;
+        goto cleanup;
+    }
+    for(i = 0; i < fleet.nports; i++)
+        fleet.ports[i].port = ports.gl_pathv[i];
+
+    printf("Loading %s onto %d devices, %d at a time.\n",
+           options->file, fleet.nports, jobs);
+    if(options->verify == DEVICE_VERIFY_SAMPLE)
+        printf("Spot-checking %d%% of writes (seed %u for the first device, "
+               "counting up).\n", options->sample, options->seed);
+    printf("Progress: ");
+
+    pthread_mutex_init(&fleet.lock, NULL);
+    pthread_key_create(&fleet_self, NULL);
+
+    for(i = 0; i < jobs; i++)
+        if(pthread_create(&workers[i], NULL, fleet_worker, NULL) != 0) {
+            rigel_error("starting fleet worker thread!\n");
+            jobs = i;
+            break;
+        }
+
+    while(fleet_progress() > 0 && jobs > 0)
+        waitus(FLEET_REFRESH);
+
+    for(i = 0; i < jobs; i++)
+        pthread_join(workers[i], NULL);
+    fleet_progress();
+
+    pthread_key_delete(fleet_self);
+    pthread_mutex_destroy(&fleet.lock);
+
+    fleet_summary();
+    if(options->stats)
+        rigel_print_stats(fleet.stats);
+    for(i = 0; i < fleet.nports; i++)
+        if(fleet.ports[i].state != FLEET_DONE)
+            failed++;
+
+cleanup:
+    free(workers);
+    free(fleet.ports);
+    if(fleet.prog)
+        rigel_program_free(largest, fleet.prog);
+    script_close(fleet.script);
+    globfree(&ports);
+
+    return failed;
+}
@@ -37,44 +37,104 @@ int hash_current = 0;
 #endif
 
 static int
-binaryf_read(const char *fn, void *mem, size_t memsize, uint32_t *start, uint32_t *end);
+binaryf_read(const char *fn, struct image *img);
 
-void *
+/* Read a .rimg file. One holding nothing but an EEPROM section (as
+ * --read=eeprom writes) is moved down to address 0, where the EEPROM
+ * loader expects its data, like a raw file. */
+static int
+rimage_load(const char *fn, struct image *img)
+{
+    struct image *tmp;
+    uint32_t i, base;
+    int ret = 0;
+
+    if(!(tmp = image_alloc(img->fill)))
+        return -1;
+    if(rimage_read(fn, tmp) == -1) {
+        image_free(tmp);
+        return -1;
+    }
+
+    img->fill = tmp->fill;
+    base = image_outside(tmp, RIMAGE_EEPROM_BASE, UINT32_MAX) ?
+           0 : RIMAGE_EEPROM_BASE;
+    for(i = 0; ret == 0 && i < tmp->nsegs; i++)
+        ret = image_put(img, tmp->segs[i].address - base,
+                        tmp->segs[i].data, tmp->segs[i].length);
+    image_free(tmp);
+
+    return ret;
+}
+
+struct image *
 rigel_program_alloc(const struct device *dev, const char *fn, int format,
 		    uint32_t *start, uint32_t *end)
 {
-    uint8_t *mem;
+    struct image *img;
+    uint32_t high = dev->mem.flash_high + 1;
+    uint16_t dev_id;
     FormatReadFunc fmt_read = inhex32_read;
 
     switch(format) {
     case IntelHexFormat: fmt_read = inhex32_read; break;
     case InnovationFirstFormat: fmt_read = ifi_bin_read; break;
     case BinaryDataFormat:      fmt_read = binaryf_read; break;
+    case RigelImageFormat:      fmt_read = rimage_load; break;
     default:
         rigel_error("unsupported data file format\n");
         return NULL;
     }
 
-    if(fmt_read(fn, NULL, dev->mem.flash_high+1, start, end) == -1)
-        return NULL;
+    /* Native images are stamped with the device they were made for. */
+    if(format == RigelImageFormat) {
+        if(rimage_device_id(fn, &dev_id) == -1) {
+            rigel_error("%s is not a rigel image!\n", fn);
+            return NULL;
+        }
+        if(dev_id && dev_id != dev->dev_id) {
+            rigel_error("%s was made for device %04Xh, not %04Xh (%s)!\n",
+                        fn, dev_id, dev->dev_id, dev->dev_name);
+            return NULL;
+        }
+    }
 
-    *end = PIC18_ALIGN_TO_ROW(*end);
-    if(!(mem = (uint8_t*)malloc(*end)))
+    /* They need no parsing, so only the text formats are worth caching */
+    if(format == RigelImageFormat) {
+        if(!(img = image_alloc(0xFF)))
+            return NULL;
+        if(fmt_read(fn, img) == -1)
+            goto error;
+    } else if(!(img = cache_read(fn, format, fmt_read)))
         return NULL;
 
-    if(fmt_read(fn, mem, *end, NULL, NULL) == -1) {
-        free(mem);
-        return NULL;
+    /* For some reason, MCC18 + MPLINK may generate configuration data
+     * in the INHEX32 file. This data is not writable on the FRC, so we
+     * only warn about it. */
+    if(image_bounds(img, high, dev->mem.config_low, start, end)) {
+        rigel_error("File %s will not fit on device!\n", fn);
+        goto error;
+    }
+    if(image_outside(img, 0, high))
+        rigel_warn("Ignoring configuration register data present in %s.\n",
+                   fn);
+
+    if(!image_bounds(img, 0, high, start, end)) {
+        rigel_error("File %s holds no program data!\n", fn);
+        goto error;
     }
 
-    return mem;
+    return img;
+
+error:
+    image_free(img);
+    return NULL;
 }
 
 void
-rigel_program_free(const struct device *dev, void *mem)
+rigel_program_free(const struct device *dev, struct image *img)
 {
-    if(mem)
-        free(mem);
+    image_free(img);
 }
 
 /* Read user program memory (does NOT include boot loader!) */
@@ -83,21 +143,18 @@ rigel_read_user(const struct device *dev, void *buffer, size_t bufsiz)
 {
     int all_erased, check = 0, erased = 0;
     uint8_t *data = (uint8_t *)buffer;
-    uint8_t  max  = dev->opts.max_packet_size;
+    uint8_t  max  = dev->opts.read_packet_size;
     uint32_t high = dev->mem.flash_high,
           low  = dev->mem.flash_low;
-    uint32_t addr, c;
+    uint32_t addr, c, fetched;
     
-    /* IFI loaders, for whatever reason, clear all the bits
-     * of program memory instead of doing the normal operation
-     * of setting them (writing only clears bits). So if we know
-     * it is an IFI controller, check for 0x00 instead of 0xFF. */
-    uint8_t erase_byte = (dev->is_ifi) ? 0x00 : 0xFF;
+    /* IFI controllers read back 0x00 for erased memory. */
+    uint8_t erase_byte = device_erased_byte(dev);
 
     if(!dev->state.connected)
         return -1;
     
-    addr = low;
+    addr = fetched = low;
     while(addr < high) {
         if((high - addr) < max)
             max = high - addr;
@@ -107,8 +164,14 @@ rigel_read_user(const struct device *dev, void *buffer, size_t bufsiz)
             max -= (addr + max - bufsiz);
         }
         
-        if(an851_rd_flash(addr, max, &data[addr]) == -1)
-            return -1;
+        /* Read ahead as far as one request goes (a whole streamed range
+         * if the bootloader can), and look at it a packet at a time */
+        if(addr + max > fetched) {
+            fetched = min(addr + DEVICE_READ_SIZE(dev), min(high, bufsiz));
+            if(device_read_range(dev, addr, fetched - addr,
+                                 &data[addr]) == -1)
+                return -1;
+        }
 
         /* If we read all FFs or 00s (erased/IFI "erased") 4 times
          * (512 bytes), it's almost surely the end of the program */
@@ -159,35 +222,20 @@ rigel_erase_device(const struct device *dev)
 }
 
 static int
-binaryf_read(const char *fn, void *mem, size_t memsize, 
-             uint32_t *start, uint32_t *end)
+binaryf_read(const char *fn, struct image *img)
 {
-    FILE *fp;
-    uint32_t _end;
+    int ret;
+    const char *map;
+    size_t length;
     
-    if(!(fp = fopen(fn, "rb")))
+    if(!(map = inhex32_map(fn, &length)))
         return -1;
         
-    fseek(fp, 0, SEEK_END);
-
-    _end = (uint32_t)ftell(fp);
-    if(_end > memsize) {
-        rigel_error("File %s will not fit on device!\n", fn);
-        return -1;
-    }
-
-    if(start && end) {
-        *start = 0;
-        *end = _end;
-    }
-
-    if(mem) {
-        rewind(fp);
-        fread(mem, 1, _end, fp);
-    }
+    if((ret = image_put(img, 0, map, length)) == -1)
+        rigel_error("allocating memory for %s!\n", fn);
     
-    fclose(fp);
-    return 0;
+    inhex32_unmap(map, length);
+    return ret;
 }
 
 static FILE *
@@ -395,7 +443,8 @@ rigel_memdump(struct device *dev, const char *file,
     int ret;
     FILE *b;
     uint8_t *mem = NULL;
-    uint32_t start, end;
+    struct image *img;
+    uint32_t start, end, base;
     size_t region_size = 0;
 
     if(!size)
@@ -455,25 +504,39 @@ rigel_memdump(struct device *dev, const char *file,
         return -1;
     }
     
-    switch(format) {
-    case IntelHexFormat:
-         inhex32_write(file, mem, start, end);
-         break;
-
-    case InnovationFirstFormat:
-         ifi_bin_write(file, mem, start, end);
-         break;
-         
-    case BinaryDataFormat:
+    if(format == BinaryDataFormat) {
         b = fopen(file, "wb");
         if(!b) {
             rigel_error("opening file for binary dump\n");
+            free(mem);
             return -1;
         }
         fwrite(mem, 1, end, b);
         fclose(b);
+    } else {
+        /* The formatted writers take just the region read */
+        /* Native images keep EEPROM in its own section */
+        base = (format == RigelImageFormat && reg == USER_EEPROM_DATA) ?
+               RIMAGE_EEPROM_BASE : 0;
+        if(!(img = image_alloc(device_erased_byte(dev))) ||
+           (end > start &&
+            image_put(img, base + start, mem + start, end - start) == -1)) {
+            rigel_error("allocating memory for dump operation!\n");
+            image_free(img);
+            free(mem);
+            return -1;
+        }
         
-        break;
+        if(format == IntelHexFormat)
+            ret = inhex32_write(file, img);
+        else if(format == RigelImageFormat)
+            ret = rimage_write(file, img, dev->dev_id);
+        else ret = ifi_bin_write(file, img);
+        image_free(img);
+        if(ret == -1) {
+            free(mem);
+            return -1;
+        }
     }
         
     free(mem);
@@ -481,3 +544,59 @@ rigel_memdump(struct device *dev, const char *file,
     
     return 0;
 }
+
+/* Print the upper bound of latency histogram bucket b */
+static void
+stats_bucket(char *buf, size_t len, int b)
+{
+    uint32_t us = 1 << (b + 1);
+    
+    if(b == AN851_HIST_BUCKETS - 1)
+        snprintf(buf, len, ">%ums", (1 << b) / 1000);
+    else if(us < 1000)
+        snprintf(buf, len, "<%uus", us);
+    else snprintf(buf, len, "<%ums", us / 1000);
+}
+
+void
+rigel_print_stats(const struct an851_stats *stats)
+{
+    int c, b;
+    char label[16];
+    const struct an851_stats *st;
+    
+    printf("\nBootloader statistics:\n"
+           "  %-12s %8s %7s %8s %4s %17s %17s %8s\n",
+           "command", "requests", "retries", "timeouts", "bad",
+           "sent raw/wire", "recv raw/wire", "time");
+    
+    for(c = 0; c < AN851_COMMAND_SLOTS; c++) {
+        st = &stats[c];
+        if(!st->requests)
+            continue;
+        
+        printf("  %-12s %8u %7u %8u %4u %8llu/%-8llu %8llu/%-8llu %6.3f s\n",
+               an851_command_name(c == AN851_SLOT(PIC_RESET) ? PIC_RESET : c),
+               st->requests, st->retries, st->timeouts, st->bad_frames,
+               (unsigned long long)st->raw_tx, (unsigned long long)st->wire_tx,
+               (unsigned long long)st->raw_rx, (unsigned long long)st->wire_rx,
+               st->time / 1e6);
+    }
+    
+    printf("\nResponse times:\n");
+    for(c = 0; c < AN851_COMMAND_SLOTS; c++) {
+        st = &stats[c];
+        if(!st->requests || st->time == 0)
+            continue;
+        
+        printf("  %-12s", an851_command_name(c));
+        for(b = 0; b < AN851_HIST_BUCKETS; b++) {
+            if(!st->hist[b])
+                continue;
+            stats_bucket(label, sizeof(label), b);
+            printf(" %s:%u", label, st->hist[b]);
+        }
+        putchar('\n');
+    }
+    putchar('\n');
+}
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/types.h>
@@ -60,7 +61,14 @@ static struct option longopts[] = {
     { "eeprom",   no_argument,       NULL, 'p' },
     { "erase",    no_argument,       NULL, 'e' },
     { "configreg",no_argument,       NULL, 'c' },
-    { "verify",   no_argument,       NULL, 'v' },
+    { "verify",   optional_argument, NULL, 'v' },
+    { "diff",     no_argument,       NULL, 'D' },
+    { "fleet",    required_argument, NULL, 'F' },
+    { "jobs",     required_argument, NULL, 'j' },
+    { "stats",    no_argument,       NULL, 'S' },
+    { "stream",   no_argument,       NULL, 'P' },
+    { "script",   no_argument,       NULL, 'X' },
+    { "no-replicate", no_argument,   NULL, 'R' },
     { "help",     no_argument,       NULL, 'h' },
     { NULL,       0,                 NULL, 0   }
 };
@@ -71,6 +79,19 @@ sigint( int sig )
     options.interrupt = 1;
 }
 
+/* Report what went on between us and the bootloader, if asked to */
+static void
+print_stats( device_t *dev )
+{
+    struct an851_stats stats[AN851_COMMAND_SLOTS];
+    
+    if(!options.stats || !dev->session)
+        return;
+    
+    device_get_stats(dev, stats);
+    rigel_print_stats(stats);
+}
+
 void
 capture_output( device_t *dev, const char *out )
 {
@@ -90,9 +111,11 @@ capture_output( device_t *dev, const char *out )
     if( !outf || sio_valid(dev->opts.fd) == -1 ) {
         device_disconnect(dev);
         rigel_fatal("opening/creating output capture file(s).\n");
-    }    
+    }
+    
+    /* Wake up every so often to check whether the user has had enough */
     while(!options.interrupt) {
-        len = sio_read(dev->opts.fd, temp, 128);
+        len = sio_read(dev->opts.fd, temp, 128, 250);
         if(len == -1) {
             rigel_error("capturing output from device\n");
             device_disconnect(dev);
@@ -153,19 +176,23 @@ print_config(const device_t *dev)
 int
 main(int argc, char **argv)
 {
-    uint8_t *prog, was_ifi;
+    struct image *prog;
+    struct flash_script *script = NULL;
+    uint8_t *dirty, *eeprom, was_ifi;
     uint32_t start, end, read_size;
-    int c, ndev;
+    int c, ndev, changed;
+    char *tail;
 
     struct device rdev, *devices[CONFIG_MAX_DEVICES];
 
     prog = NULL;
+    dirty = eeprom = NULL;
     was_ifi = 0;
     memset(&options, 0, sizeof(struct rigel_options));
     options.run = 1;
     options.fmt = IntelHexFormat;
     
-    while((c = getopt_long(argc, argv, "mcpviIhzf:l:a::r::t::s:d::",
+    while((c = getopt_long(argc, argv, "mcpv::iIhzf:l:a::r::t::s:d::DF:j:SPXR",
                            longopts, NULL)) != -1) {
         switch (c) {
         case 's':
@@ -188,12 +215,41 @@ main(int argc, char **argv)
         
         case 'l': options.etc    = optarg; break;
         case 'c': options.conf   = 1; break;
-        case 'v': options.verify = 1; break;
+        case 'v':
+            if(!optarg || strncasecmp(optarg, "after", 5) == 0)
+                options.verify = DEVICE_VERIFY_AFTER;
+            else if(strncasecmp(optarg, "each", 4) == 0)
+                options.verify = DEVICE_VERIFY_EACH;
+            else if(strncasecmp(optarg, "sample:", 7) == 0) {
+                /* sample:N%[:SEED] */
+                options.verify = DEVICE_VERIFY_SAMPLE;
+                options.sample = strtol(optarg + 7, &tail, 10);
+                if(*tail == '%')
+                    tail++;
+                if(*tail == ':')
+                    options.seed = strtoul(tail + 1, &tail, 0);
+                else options.seed = time(NULL) ^ getpid();
+                if(optarg[7] < '0' || optarg[7] > '9' || *tail ||
+                   options.sample > 100)
+                    rigel_fatal("invalid verify mode %s specified; must be "
+                                "sample:N%%, N from 0 to 100.\n", optarg);
+            }
+            else rigel_fatal("invalid verify mode %s specified; "
+                             "must be one of after, each, sample:N%%.\n",
+                             optarg);
+            break;
         case 'p': options.eeprom = 1; break;
         case 'e': options.erase  = 1; break;
         case 'm': options.master = 1; break;
         case 'i': options.noifi  = 1; break;
         case 'I': options.ifi    = 1; break;
+        case 'D': options.diff   = 1; break;
+        case 'F': options.fleet  = optarg; break;
+        case 'j': options.jobs   = atoi(optarg); break;
+        case 'S': options.stats  = 1; break;
+        case 'P': options.stream = 1; break;
+        case 'X': options.script = 1; break;
+        case 'R': options.noreplicate = 1; break;
         
         case 'd':
             if(optarg && strncasecmp(optarg, "boot", 4) == 0)
@@ -210,9 +266,11 @@ main(int argc, char **argv)
                 options.fmt = InnovationFirstFormat;
             else if(strncasecmp(optarg, "raw", 3) == 0)
                 options.fmt = BinaryDataFormat;
+            else if(strncasecmp(optarg, "rimg", 4) == 0)
+                options.fmt = RigelImageFormat;
                 
             else rigel_fatal("invalid file format %s specified; "
-                       "must be one of hex, bin, raw.\n", optarg);
+                       "must be one of hex, bin, raw, rimg.\n", optarg);
 
             break;
 
@@ -260,6 +318,27 @@ main(int argc, char **argv)
         goto usage;
     }
     
+    if(options.script && (options.eeprom || options.master ||
+                           options.diff || options.stream)) {
+        rigel_rc_free(devices);
+        rigel_fatal("--script can't be used with --eeprom, --master, "
+                    "--diff or --stream.\n");
+    }
+    
+    /* Fleet mode only loads programs; everything else is per-device. */
+    if(options.fleet) {
+        if(!options.file || options.dump || options.term || options.conf ||
+           options.eeprom) {
+            rigel_rc_free(devices);
+            rigel_fatal("--fleet can only be used to load a program.\n");
+        }
+        
+        c = rigel_fleet(&options, devices, ndev);
+        rigel_rc_free(devices);
+        
+        return (c == 0) ? 0 : 1;
+    }
+    
     if(!options.device)
         options.device = DEFAULT_SERIAL_PORT;
     
@@ -328,6 +407,12 @@ main(int argc, char **argv)
          * (128K on a PIC18F8722, for example), and attempt to read
          * the HEX file into this program. */
         rdev.opts.verify_on_write = options.verify;
+        rdev.opts.replicate = !options.noreplicate;
+        if(options.verify == DEVICE_VERIFY_SAMPLE) {
+            device_set_sampling(&rdev, options.sample, options.seed);
+            printf("Spot-checking %d%% of writes (seed %u).\n",
+                   options.sample, options.seed);
+        }
 
         device_set_callback(&rdev, load_update);
                 
@@ -336,10 +421,59 @@ main(int argc, char **argv)
             printf("FRC master processor firmware update:\n"
                    "\tThis will overwrite your controller's current program;\n"
                    "\tplease remember to reload after the update.\n");
-            rdev.opts.verify_on_write = 1;
+            if(!options.verify)
+                rdev.opts.verify_on_write = DEVICE_VERIFY_AFTER;
             options.fmt = InnovationFirstFormat;
         }
         
+        /* A flash script already holds every frame of the load, so
+         * there's nothing to parse or plan. */
+        if(options.script) {
+            if(!(script = script_open(options.file)))
+                goto r_error;
+            
+            if(options.erase) {
+                printf( BLUE("Erasing: ") );
+                rigel_erase_device(&rdev);
+            }
+            
+            printf("\nLoading flash script %s (%d frames) -\n"
+                   BLUE("Loading: "), options.file, script->nframes);
+            if(script_run(&rdev, script) == -1) {
+                rigel_error("Program load failed! Check your connection.\n");
+                goto r_error;
+            }
+            printf("Complete!\n");
+            goto cleanup;
+        }
+        
+        /* Streaming trades checking the whole file before touching the
+         * device for starting to load straight away. */
+        if(options.stream && (options.eeprom || options.master ||
+                              options.diff ||
+                              options.fmt != IntelHexFormat)) {
+            rigel_warn("--stream only loads HEX programs; "
+                       "parsing the whole file first.\n");
+            options.stream = 0;
+        }
+        if(options.stream) {
+            if(options.erase) {
+                printf( BLUE("Erasing: ") );
+                rigel_erase_device(&rdev);
+            }
+            
+            printf("\nStreaming program from %s -\n" BLUE("Loading: "),
+                   options.file);
+            fflush(stdout);
+            if((c = rigel_stream_load(&rdev, options.file)) == -1) {
+                rigel_error("Program load failed! The device may be "
+                            "partly loaded.\n");
+                goto r_error;
+            }
+            printf("Complete! %d row(s) written.\n", c);
+            goto cleanup;
+        }
+        
         /* Map our program to memory so we know if it is valid before we
          * wipe the user's device. :) */
         if(!(prog = rigel_program_alloc(&rdev, options.file, options.fmt,
@@ -358,7 +492,12 @@ main(int argc, char **argv)
 			    "to %d bytes.\n", rdev.mem.eeprom_high);
                 goto r_error;
             }
-            if(device_write_eeprom(&rdev, start, end - start, prog) == -1) {
+            if(!(eeprom = (uint8_t *)malloc(end - start))) {
+                rigel_error("allocating memory for EEPROM data!\n");
+                goto r_error;
+            }
+            image_get(prog, start, eeprom, end - start);
+            if(device_write_eeprom(&rdev, start, end - start, eeprom) == -1) {
                 rigel_error("EEPROM write failed! Aborting.\n");
                 goto r_error;
             }
@@ -371,17 +510,46 @@ main(int argc, char **argv)
                "available flash memory) -\n", options.file,
                (float)(end-start) / (rdev.mem.flash_high - rdev.mem.flash_low) * 100);
                           
-        printf( BLUE("Erasing: ") );
-
+        if(options.diff && options.erase)
+            rigel_warn("Erasing the whole device; ignoring --diff.\n");
+        
+        /* In --diff mode, read back what is already on the device and only
+         * erase and rewrite the rows that have changed. */
+        if(options.diff && !options.erase) {
+            if(!(dirty = (uint8_t *)malloc(DEVICE_ROWS(end)))) {
+                rigel_error("allocating memory for row map!\n");
+                goto r_error;
+            }
+            
+            printf( BLUE("Comparing: ") );
+            if((changed = device_diff_flash(&rdev, prog, dirty)) == -1) {
+                rigel_error("Device read failed! Check your connection.\n");
+                goto r_error;
+            }
+            printf("%d row(s) changed.\n", changed);
+            
+            if(changed) {
+                printf( BLUE("Loading: ") );
+                if(device_load_rows(&rdev, prog, dirty) == -1) {
+                    rigel_error("Program load failed! Check your connection.\n");
+                    goto r_error;
+                }
+            }
+            printf("Complete!\n");
+            goto cleanup;
+        }
+        
 	/* If the -e flag is specified, force erasing the whole device. Otherwise,
 	 * only erase what is necessary to load the program (reduces load time
-	 * slightly and allows for loading two segments of the flash separately) */
-	if(options.erase)
+	 * slightly and allows for loading two segments of the flash separately);
+	 * device_load_program erases that as it goes. */
+	if(options.erase) {
+            printf( BLUE("Erasing: ") );
 	    rigel_erase_device(&rdev);
-        else device_erase_flash(&rdev, start, (end - start) / BYTES_PER_ROW);
+        }
 
         printf( BLUE("Loading: ") );
-        if(device_load_program(&rdev, prog, start, end) == -1) {
+        if(device_load_program(&rdev, prog) == -1) {
             rigel_error("Program load failed! Check your connection.\n");
             goto r_error;
         }
@@ -391,6 +559,11 @@ main(int argc, char **argv)
 cleanup:
     if(prog)
         rigel_program_free(&rdev, prog);
+    script_close(script);
+    if(dirty)
+        free(dirty);
+    if(eeprom)
+        free(eeprom);
     
     if(options.run) {
         
@@ -417,6 +590,7 @@ cleanup:
         printf("Device reset (program not running); disconnecting.\n\n");
     }
     
+    print_stats(&rdev);
     device_disconnect(&rdev);
     return 0;
 
@@ -434,7 +608,8 @@ printf(
    "     --read=REG    Dump memory region to HEX file. Valid: program (default),\n"
    "                   boot, eeprom.\n"
    " -f, --format=FMT  Specify the format for the input or output program.\n"
-   "                   Valid: hex (INHEX32), bin (IFI BIN), raw (binary data)\n"
+   "                   Valid: hex (INHEX32), bin (IFI BIN), raw (binary data),\n"
+   "                   rimg (rigel's native image, with CRCs)\n"
    " -r, --run=yes,no  Run program after all operations complete [default].\n"
    " -e, --erase       Force erase a device. Implied for program loads.\n"
    " -i, --no-ifi      Disable IFI erase extensions for IFI controllers.\n"
@@ -444,7 +619,28 @@ printf(
    " -c, --configreg   Print out various configuration register info.\n"
    " -l, --devlist     Use file CONF for device configuration settings.\n"
    "                   Defaults to ~/.rigelrc or /etc/rigelrc.\n"
-   " -v, --verify      Verify all write operations to the device.\n"
+   " -v, --verify[=each,sample:N%%[:SEED]]\n"
+   "                   Verify all write operations to the device: read back\n"
+   "                   everything once it is written and rewrite rows that\n"
+   "                   differ, or with each, read back every packet. sample\n"
+   "                   only reads back N%% of them at random, plus any that\n"
+   "                   were retried, until one differs.\n"
+   "     --diff        Read back the device and only rewrite the rows of the\n"
+   "                   program that have changed.\n"
+   "     --fleet=PORTS Load FILENAME onto every device in PORTS at once. PORTS\n"
+   "                   is a comma-separated list of TTY devices or patterns,\n"
+   "                   i.e. --fleet='/dev/ttyUSB*'.\n"
+   "     --jobs=N      Load at most N devices at a time in fleet mode.\n"
+   "     --stream      Start loading a HEX program while it is still being\n"
+   "                   read (i.e. from a pipe, with FILENAME -). A bad file\n"
+   "                   leaves the device partly loaded.\n"
+   "     --no-replicate\n"
+   "                   Always send the data of every write, for bootloaders\n"
+   "                   without the AN851 replicate command.\n"
+   "     --script      FILENAME is a flash script compiled by hextool; send\n"
+   "                   its frames as they are.\n"
+   "     --stats       Report requests, retries, bytes and response times for\n"
+   "                   each bootloader command at the end of the run.\n"
    " -h, --help        Display this message.\n"
    " FILENAME          Filename to load program from, or dump memory to.\n\n"
    "Report bugs to <hbock@providence.edu>.\n",
@@ -455,7 +651,13 @@ printf(
 r_error:
     if(prog)
         rigel_program_free(&rdev, prog);
+    script_close(script);
+    if(dirty)
+        free(dirty);
+    if(eeprom)
+        free(eeprom);
     
+    print_stats(&rdev);
     device_disconnect(&rdev);
     exit(1);
 }
@@ -28,6 +28,9 @@
 
 #include "device.h"
 #include "inhex32.h"
+#include "cache.h"
+#include "rimage.h"
+#include "script.h"
 #include "serialio.h"
 
 #define LOADER_MAJOR_VERSION 1
@@ -43,17 +46,26 @@ typedef enum {
 
 typedef struct rigel_options {
    char *device, *config, *file, *fterm, *etc;
+   char *fleet;  /* Serial ports (or patterns) to load in fleet mode */
+   int jobs;     /* Maximum number of fleet devices to load at once */
    byte dump;    /* Dump a region of memory to file (program, EEPROM, etc.) */
    byte dumpall; /* Force complete dump (no checking for end of prog. mem) */
    byte conf;    /* Output useful configuration register settings. */
    byte run;     /* Run program before disconnect (default true) */
    byte term;    /* Read output of TTY port immediately upon running. */
-   byte verify;  /* Verify write operations. */
+   byte verify;  /* Verify write operations (DEVICE_VERIFY_*). */
+   int sample;   /* Percent of writes read back with --verify=sample */
+   uint32_t seed; /* Seed picking them */
    byte fmt;     /* Dump to binary file instead of HEX */
    byte eeprom;  /* Load a binary file to EEPROM. */
    byte erase;   /* Erase the device. */
+   byte diff;    /* Only rewrite rows that differ from the device. */
+   byte stats;   /* Report bootloader statistics at the end of the run */
+   byte stream;  /* Load rows while the HEX file is still being parsed */
+   byte script;  /* FILE is a flash script compiled by hextool */
    byte master;  /* Perform operations on IFI master processor */
    byte noifi;   /* Disable IFI extensions */
+   byte noreplicate; /* Never send replicate writes */
    byte ifi;     /* Force IFI extensions */
    byte help;    /* Display short usage or full help */
    byte interrupt;
@@ -64,6 +76,10 @@ typedef struct rigel_options {
 int rigel_rc_parse(const char *fn,
                    struct device **devlist);
      
+int rigel_rc_load(const char *rigelrc,
+                  struct device **devlist,
+                  size_t max_devices);
+
 void rigel_rc_free(struct device **);
 
 int rigel_memdump(struct device *dev,
@@ -74,15 +90,21 @@ int rigel_memdump(struct device *dev,
 
 void load_update(dword, dword);
 
+/* Print a report of the AN851 statistics in stats (as filled in by
+ * device_get_stats). */
+void rigel_print_stats(const struct an851_stats *stats);
+
 /* Load a program or binary file into memory from any of the following
- * formats: INHEX32, IFI BIN, raw data. Returns a newly allocated block
- * of memory containing the program data specified in the arg fn.
+ * formats: INHEX32, IFI BIN, raw data. Returns a newly allocated image
+ * (see image.h) containing the program data specified in the arg fn.
  * Arguments start and end will be filled with the starting and ending
- * addresses of the data in the file fn.
+ * addresses of the data in the file fn that lies in the device's flash;
+ * configuration data beyond it is kept in the image, but anything else
+ * that won't fit is an error.
  * Must be freed with rigel_program_free. */
-void *rigel_program_alloc(const struct device *dev, const char *fn, int format,
-                          uint32_t *start, uint32_t *end);
-void rigel_program_free(const struct device *dev, void *mem);
+struct image *rigel_program_alloc(const struct device *dev, const char *fn,
+                                  int format, uint32_t *start, uint32_t *end);
+void rigel_program_free(const struct device *dev, struct image *img);
 
 /* Reads the entire programmable region of flash memory to buffer, stopping
  * when it reads max_packet_size bytes of erased memory. */
@@ -92,4 +114,21 @@ int rigel_read_user(const struct device *dev, void *buffer, size_t bufsiz);
  * device flash memory into buffer. */
 int rigel_read_loader(const struct device *dev, void *buffer, size_t bufsiz);
 
+/* Erase all of the user (non-boot) flash memory on the device. */
+int rigel_erase_device(const struct device *dev);
+
+/* Load the HEX file fn ("-" for standard input) onto dev while it is
+ * still being parsed, erasing and writing each row once the file has moved
+ * past it. Returns the number of rows written, or -1 on failure; since
+ * the device is written as the file is read, a bad file leaves it
+ * partly loaded. */
+int rigel_stream_load(struct device *dev, const char *fn);
+
+/* Load options->file onto every serial port listed in options->fleet
+ * concurrently, printing aggregated progress and a per-port summary.
+ * Returns the number of devices that failed, or -1 on setup errors. */
+int rigel_fleet(const rigel_t *options,
+                struct device **devlist,
+                int ndev);
+
 #endif /* _RIGEL_COMMON_H */
@@ -0,0 +1,212 @@
+/* -*- mode: C; c-file-style: "k&r"; c-basic-offset: 4; indent-tabs-mode: nil; -*- */
+
+/* Streaming loads: one thread parses the HEX file while another erases
+ * and writes its rows to the device as soon as they are complete, so a
+ * slow file (or pipe) and the serial link are kept busy at the same time. */
+
+/*  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "rigel.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <pthread.h>
+
+/* Rows the parser may get ahead of the device by */
+#define STREAM_QUEUE_ROWS 64
+
+struct stream_row {
+    uint32_t address;
+    uint8_t data[BYTES_PER_ROW];
+};
+
+struct stream {
+    struct device *dev;
+
+    /* The writer's copy of the program, and the rows of it to write next */
+    uint8_t *image, *dirty;
+    uint32_t size;
+
+    /* End of the rows loaded so far */
+    uint32_t next;
+
+    struct stream_row queue[STREAM_QUEUE_ROWS];
+    int head, count;
+    int done, failed;
+    int written;
+
+    /* Protects the queue and the flags above; ready is signalled when
+     * rows are queued (or parsing ends), room when rows are taken. */
+    pthread_mutex_t lock;
+    pthread_cond_t ready, room;
+};
+
+/* Called by the parser with each complete row; blocks while the queue
+ * is full. */
+static int
+stream_emit(uint32_t address, const uint8_t *row, void *arg)
+{
+    struct stream *st = (struct stream *)arg;
+    struct stream_row *r;
+
+    pthread_mutex_lock(&st->lock);
+    while(st->count == STREAM_QUEUE_ROWS && !st->failed)
+        pthread_cond_wait(&st->room, &st->lock);
+
+    if(st->failed) {
+        pthread_mutex_unlock(&st->lock);
+        return -1;
+    }
+
+    r = &st->queue[(st->head + st->count) % STREAM_QUEUE_ROWS];
+    r->address = address;
+    memcpy(r->data, row, BYTES_PER_ROW);
+    st->count++;
+
+    pthread_cond_signal(&st->ready);
+    pthread_mutex_unlock(&st->lock);
+
+    return 0;
+}
+
+/* Take every row queued so far and load them onto the device together,
+ * so that neighbouring rows share erase and write requests. */
+static void *
+stream_writer(void *arg)
+{
+    struct stream *st = (struct stream *)arg;
+    struct stream_row *r;
+    struct plan *plan;
+    uint32_t low, high;
+    int rows, ret;
+
+    for(;;) {
+        pthread_mutex_lock(&st->lock);
+        while(!st->count && !st->done && !st->failed)
+            pthread_cond_wait(&st->ready, &st->lock);
+
+        if(st->failed || !st->count) {
+            pthread_mutex_unlock(&st->lock);
+            break;
+        }
+
+        low = st->size;
+        high = rows = 0;
+        for(; st->count; st->count--) {
+            r = &st->queue[st->head];
+            st->head = (st->head + 1) % STREAM_QUEUE_ROWS;
+
+            memcpy(st->image + r->address, r->data, BYTES_PER_ROW);
+            st->dirty[r->address / BYTES_PER_ROW] = 1;
+            low  = min(low, r->address);
+            high = max(high, r->address + BYTES_PER_ROW);
+            rows++;
+        }
+        pthread_cond_signal(&st->room);
+        pthread_mutex_unlock(&st->lock);
+
+        /* Erase any gap the file skipped over since the last rows, as
+         * loading the whole file at once would have. */
+        if(st->written && low > st->next) {
+            memset(st->dirty + st->next / BYTES_PER_ROW, 1,
+                   (low - st->next) / BYTES_PER_ROW);
+            low = st->next;
+        }
+        st->next = max(st->next, high);
+
+        ret = -1;
+        if((plan = plan_build(st->image, low, high, st->dirty, NULL,
+                              st->dev->mem.flash_low,
+                              device_erased_byte(st->dev),
+                              DEVICE_MAX_WRITE / BYTES_PER_BLOCK))) {
+            ret = device_run_plan(st->dev, st->image, plan);
+            plan_free(plan);
+        }
+        memset(st->dirty + low / BYTES_PER_ROW, 0,
+               (high - low) / BYTES_PER_ROW);
+
+        pthread_mutex_lock(&st->lock);
+        if(ret == -1) {
+            st->failed = 1;
+            pthread_cond_signal(&st->room);
+        } else st->written += rows;
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    return NULL;
+}
+
+int
+rigel_stream_load(struct device *dev, const char *fn)
+{
+    int ret = -1;
+    uint8_t *parsed;
+    pthread_t writer;
+    struct stream st;
+    DeviceUpdateCallback update = dev->update_func;
+
+    memset(&st, 0, sizeof(struct stream));
+    st.dev  = dev;
+    st.size = dev->mem.flash_high + 1;
+
+    parsed   = (uint8_t *)malloc(st.size);
+    st.image = (uint8_t *)malloc(st.size);
+    st.dirty = (uint8_t *)calloc(DEVICE_ROWS(st.size), 1);
+    if(!parsed || !st.image || !st.dirty) {
+        rigel_error("allocating memory for streaming load!\n");
+        goto cleanup;
+    }
+    memset(st.image, 0xFF, st.size);
+
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.ready, NULL);
+    pthread_cond_init(&st.room, NULL);
+
+    /* There is no telling how much is left to load, so no progress bar */
+    dev->update_func = NULL;
+
+    if(pthread_create(&writer, NULL, stream_writer, &st) != 0) {
+        rigel_error("starting streaming writer thread!\n");
+        goto destroy;
+    }
+
+    ret = inhex32_stream(fn, parsed, st.size, stream_emit, &st);
+
+    pthread_mutex_lock(&st.lock);
+    if(ret == -1)
+        st.failed = 1;
+    st.done = 1;
+    pthread_cond_signal(&st.ready);
+    pthread_mutex_unlock(&st.lock);
+
+    pthread_join(writer, NULL);
+    ret = st.failed ? -1 : st.written;
+
+destroy:
+    dev->update_func = update;
+    pthread_cond_destroy(&st.room);
+    pthread_cond_destroy(&st.ready);
+    pthread_mutex_destroy(&st.lock);
+
+cleanup:
+    free(parsed);
+    free(st.image);
+    free(st.dirty);
+
+    return ret;
+}
@@ -1,9 +1,11 @@
 /* This has to be the most ridiculous program I've ever written. */
 
+/* posix_openpt() and friends */
+#define _XOPEN_SOURCE 600
+
 #include "an851d.h"
 
 #include <stdio.h>
-#define __USE_XOPEN
 #include <stdlib.h>
 #include <string.h>
 
@@ -14,6 +16,7 @@
 
 #include "pic18.h"
 #include "inhex32.h"
+#include "rimage.h"
 #include "serialio.h"
 
 /* AN851 daemon state machine */
@@ -26,113 +29,132 @@ static struct pic18_memory_layout limits = { 0x000800, 0x01FFFF, 0x000000, 0x000
 /* Internal "working space" */
 static uint8_t internal[INTERNAL_BUFFER_SIZE];
 
+/* Incoming packets are decoded byte by byte by the librigel decoder */
+static struct an851_decoder decoder;
+static struct an851_packet rx_packet;
+
 static int boot_mode;
-static int escape;
-static int synchronized;
 
 static int fd;
 static int tx_packets, rx_packets;
 static int rx_errors;
 
+/* The data of the last WR_FLASH, which a replicate write (a WR_FLASH
+ * with no data) writes again; any other command overwrites it. */
+static uint8_t write_data[MAX_DATA_LENGTH];
+static int write_valid;
+
 static uint8_t rx_command, tx_command;
 static uint16_t version, devid;
+static uint8_t caps = AN851D_CAPS;
+static uint8_t mode; /* Extensions switched on by SET_MODE, until RESET */
 
 static int valid_flash(dword address, dword length);
 static int valid_eeprom(dword address, dword length);
 static int valid_config(dword address, dword length);
 static int an851d_rd( byte cmd, dword addr, byte length, void *data );
 static int internal_tx( word length );
-static int process_packet( byte *data, word len );
+static int process_packet( struct an851_packet *p );
 
 
 
 int an851d_main( void )
 {
-    int len = 0;
+    int i, len = 0;
     byte data[INTERNAL_BUFFER_SIZE * 2];
     
-    sio_settimeout(0);
+    an851_decoder_init(&decoder, &rx_packet);
+    
     while(boot_mode) {
-        len = sio_read(fd, data, sizeof(data));
-        if(len <= 0) continue;
-        
-        while(!(data[len-1] == ETX && data[len-2] != DLE)) {
-            len += sio_read(fd, &data[len], sizeof(data) - len);
+        /* Block until the host sends something. While no host has the
+         * slave side open, reads fail straight away; don't spin on that. */
+        len = sio_read_until(fd, data, sizeof(data), NULL);
+        if(len <= 0) {
+            waitus(SERIAL_GRACE_TIMEOUT);
+            continue;
         }
         
-        //if( (len = an851_wait_response(data, sizeof(data))) == -1 ) {
-        //    rigel_warn("Error in reading serial port\n");
-        //    rx_errors++;
-        //}
-        
-            
-        if(len == 0) continue;
-        
-        if(process_packet(data, len) == -1) {
-            rx_errors++;
-            rigel_warn("RX error (%d total)\n", rx_errors);
-        } else rx_packets++;
-        len = 0;
+        for(i = 0; i < len; i++) {
+            switch(an851_decoder_feed(&decoder, data[i])) {
+            case AN851_RX_ERROR:
+                rx_errors++;
+                rigel_warn("RX error: corrupt frame (%d total)\n", rx_errors);
+                break;
+                
+            case AN851_RX_FRAME:
+                if(process_packet(&rx_packet) == -1) {
+                    rx_errors++;
+                    rigel_warn("RX error (%d total)\n", rx_errors);
+                } else rx_packets++;
+                break;
+            }
+        }
         fflush(stdout);
     }
     return 0;
 }
 
-static int process_packet(byte *buf, word rxlen)
+static int process_packet( struct an851_packet *p )
 {
-    int i, chk = 0;
-    byte length, checksum;
+    byte length;
     dword address;
     
-    /* Strip control characters from received data */
-    for(i = 0, length = 0; i < rxlen; i++) {
-        if(IS_CONTROL(buf[i])) {
-            if(buf[i] == DLE)
-                internal[length++] = buf[++i];
-            else
-                i++;
-        } else {
-            internal[length] = buf[i];
-            length++;
-        }
-    }
-        
-    /* Get the packet checksum */
-    for(i = 0; i < length - 1; i++)
-        chk += internal[i];
-    
-    checksum = ((~chk + 1) & 0xFF);
-    
-    if( checksum != internal[length-1] ) {
-        rigel_warn("rx checksum mismatch! got %02X, calculated %02X\n",
-             internal[length-1], checksum);
-        return -1;
-    }
-    
-    rx_command = internal[0];
+    rx_command = p->command;
     
     /* This is safe to do, even if the packet is less than 5 bytes,
-     * because our internal buffer is always INTERNAL_BUFFER_SIZE */
-    length = internal[1];
-    address = ADDRESS(internal[2], internal[3], internal[4]);
+     * because the packet data is always MAX_PACKET_SIZE */
+    length = p->data[0];
+    address = ADDRESS(p->data[1], p->data[2], p->data[3]);
+    
+    if(rx_command == WR_FLASH) {
+        if(p->length == 4) {
+            if(!write_valid) {
+                rigel_warn("Replicate write with nothing to replicate!\n");
+                return -1;
+            }
+            printf("(replicate) ");
+        } else {
+            memcpy(write_data, &p->data[4],
+                   min(length * BYTES_PER_BLOCK, MAX_DATA_LENGTH));
+            write_valid = 1;
+        }
+    } else write_valid = 0;
         
     switch(rx_command) {
     case RD_VERSION: return an851d_version();
     case RD_CONFIG: return an851d_rd_config(address, length); 
     case RD_FLASH:  return an851d_rd_flash(address, length);
     case RD_EEDATA: return an851d_rd_eeprom(address, length);
-    case WR_FLASH:  return an851d_wr_flash(address, length, &internal[5]);
-    case WR_EEDATA: return an851d_wr_eeprom(address, length, &internal[5]);
+    case WR_FLASH:  return an851d_wr_flash(address, length, write_data);
+    case WR_EEDATA: return an851d_wr_eeprom(address, length, &p->data[4]);
     case ER_FLASH:  return an851d_er_flash(address, length);
-    case IFI_WR_ROW: return ifi_wr_row(address, length, internal[5]);
+    case IFI_WR_ROW: return an851d_ifi_wr_row(address, length, p->data[4]);
     case IFI_RUN_CODE:
         printf("IFI_RUN_CODE (user disconnect?)\n");
         return 0;
             
+    /* Extensions we haven't been told to have are unknown commands, like
+     * any other */
+    case RD_CRC:
+        if(caps & AN851_CAP_CRC)
+            return an851d_rd_crc(address, p->data[4], length);
+        goto unknown;
+    case SET_MODE:
+        if(caps)
+            return an851d_set_mode(p->data[0]);
+        goto unknown;
+    case RD_RANGE:
+        if(caps & AN851_CAP_RANGE)
+            return an851d_rd_range(address, ADDRESS(p->data[4], p->data[5],
+                                                    p->data[6]), length);
+        goto unknown;
+            
     default:
+    unknown:
         printf("RESET [%02X]\n", rx_command);
         rx_errors = 0;
         rx_packets = tx_packets = 0;
+        mode = 0;
         
         return 0;
     }
@@ -175,16 +197,14 @@ int an851d_initialize( const char *port, const char *inithex )
     memset(eeprom, 0xFF, limits.eeprom_high);
     memset(flash,  0x00, limits.flash_high);
     
-    synchronized = escape = 0;
     tx_packets = rx_packets = 0;
     rx_errors = 0;
     boot_mode = 1;
     
-    sio_settimeout( 0 );
     return an851d_main();
 }
 
-int ifi_wr_row(uint32_t address, uint8_t rows, uint8_t val)
+int an851d_ifi_wr_row(dword address, byte rows, byte val)
 {
     printf("IFI_WR_ROW 0x%06X, %d rows (0x%06X bytes), value 0x%02X\n",
            address, rows, rows * BYTES_PER_ROW, val);
@@ -194,11 +214,11 @@ int ifi_wr_row(uint32_t address, uint8_t rows, uint8_t val)
     return internal_tx(1);
 }
 
-int an851d_er_flash(uint32_t address, uint8_t blocks)
+int an851d_er_flash(uint32_t address, uint8_t rows)
 {
-    uint32_t bytes = blocks * BYTES_PER_BLOCK;
+    uint32_t bytes = rows * BYTES_PER_ROW;
     
-    printf("ER_FLASH 0x%06X, %d blocks (0x%06X bytes)\n", address, blocks, bytes);
+    printf("ER_FLASH 0x%06X, %d rows (0x%06X bytes)\n", address, rows, bytes);
     if(address < limits.flash_low || address + bytes > limits.flash_high) {
         rigel_warn("Invalid flash erase req to address %06X of length %d\n.",
              address, bytes);
@@ -226,6 +246,95 @@ int an851d_rd_flash(dword address, byte length)
     return an851d_rd(RD_FLASH, address, length, &flash[address]);
 }
 
+int an851d_rd_crc(dword address, byte blocks, byte count)
+{
+    int i;
+    uint32_t crc, span = blocks * BYTES_PER_BLOCK;
+    
+    printf("RD_CRC 0x%06X, %d x 0x%04X bytes\n", address, count, span);
+    if( count > AN851_CRC_MAX || !valid_flash(address, count * span) ) {
+        rigel_warn("Invalid CRC req to address %06X of %d x %d bytes.\n",
+             address, count, span);
+        return -1;
+    }
+    
+    internal[0] = RD_CRC;
+    internal[1] = count;
+    internal[2] = ADDRL(address);
+    internal[3] = ADDRH(address);
+    internal[4] = ADDRU(address);
+    internal[5] = blocks;
+    for(i = 0; i < count; i++) {
+        crc = rimage_crc(0, &flash[address + i * span], span);
+        internal[6 + 4 * i]     = crc & 0xFF;
+        internal[6 + 4 * i + 1] = (crc >> 8) & 0xFF;
+        internal[6 + 4 * i + 2] = (crc >> 16) & 0xFF;
+        internal[6 + 4 * i + 3] = crc >> 24;
+    }
+    
+    return internal_tx(6 + 4 * count);
+}
+
+/* Send length bytes of flash from address back as one RD_FLASH-like
+ * frame of up to chunk bytes after another, without waiting in between */
+int an851d_rd_range(dword address, dword length, byte chunk)
+{
+    dword done, at;
+    byte n;
+    
+    printf("RD_RANGE 0x%06X, 0x%06X bytes in 0x%02X byte frames\n",
+           address, length, chunk);
+    if( chunk == 0 || chunk > MAX_DATA_LENGTH ||
+        address + length > limits.flash_high ) {
+        rigel_warn("Invalid range read req to address %06X of length %d.\n",
+             address, length);
+        return -1;
+    }
+    
+    for(done = 0; done < length; done += n) {
+        n = min(chunk, length - done);
+        at = address + done;
+        internal[0] = RD_RANGE;
+        internal[1] = n;
+        internal[2] = ADDRL(at);
+        internal[3] = ADDRH(at);
+        internal[4] = ADDRU(at);
+        memcpy(&internal[5], &flash[at], n);
+        if(internal_tx(n + 5) == -1)
+            return -1;
+    }
+    
+    return 0;
+}
+
+int an851d_set_mode(byte flags)
+{
+    mode = flags & caps & AN851_CAP_WRSUM;
+    printf("SET_MODE %02X\n", mode);
+    
+    internal[0] = SET_MODE;
+    internal[1] = mode;
+    return internal_tx(2);
+}
+
+/* Acknowledge a write; with AN851_CAP_WRSUM on, along with the CRC-32 of
+ * what memory now holds where it wrote. */
+static int write_ack(byte cmd, const uint8_t *written, dword length)
+{
+    uint32_t crc;
+    
+    internal[0] = cmd;
+    if(!(mode & AN851_CAP_WRSUM))
+        return internal_tx(1);
+    
+    crc = rimage_crc(0, written, length);
+    internal[1] = crc & 0xFF;
+    internal[2] = (crc >> 8) & 0xFF;
+    internal[3] = (crc >> 16) & 0xFF;
+    internal[4] = crc >> 24;
+    return internal_tx(5);
+}
+
 int an851d_rd_config(dword address, byte length)
 {
     printf("RD_CONFIG 0x%06X, %02X bytes\n", address, length);
@@ -255,8 +364,7 @@ int an851d_wr_eeprom(word address, byte length, void *data)
     printf("WR_EEDATA 0x%06X, %02X bytes\n", address, length);
     memcpy(&eeprom[address], data, length);
     
-    internal[0] = WR_EEDATA;
-    return internal_tx(1);
+    return write_ack(WR_EEDATA, &eeprom[address], length);
 }
 
 int an851d_wr_flash(dword address, byte blocks, void *data)
@@ -270,8 +378,7 @@ int an851d_wr_flash(dword address, byte blocks, void *data)
     
     memcpy(&flash[address], data, blocks * BYTES_PER_BLOCK);
     
-    internal[0] = WR_FLASH;
-    return internal_tx(1);
+    return write_ack(WR_FLASH, &flash[address], blocks * BYTES_PER_BLOCK);
 }
 
 int an851d_version( void )
@@ -283,6 +390,12 @@ int an851d_version( void )
     internal[2] = LOBYTE(version);
     internal[3] = HIBYTE(version);
     
+    /* Extensions are announced after the version */
+    if(caps) {
+        internal[1] = 0x03;
+        internal[4] = caps;
+        return internal_tx(5);
+    }
     return internal_tx(4);
 }
 
@@ -318,28 +431,12 @@ static int an851d_rd( byte cmd, dword addr, byte length, void *data )
 
 static int internal_tx( word length )
 {
-    int i, c, chk = 0;
-    byte checksum;
-    static byte buffer[INTERNAL_BUFFER_SIZE * 2] = { STX, STX };
+    static byte buffer[AN851_FRAME_SIZE(INTERNAL_BUFFER_SIZE)];
      
     tx_command = internal[0];
     
-    /* Get the packet checksum */
-    for(c = 0; c < length; c++)
-        chk += internal[c];
-    checksum = ((~chk + 1) & 0xFF);
-    
-    /* Escape all control characters within the data as we copy */
-    for(i = 0, c = 2; i < length; i++, c++) {
-        if(IS_CONTROL(internal[i]))
-            buffer[c++] = DLE;
-        buffer[c] = internal[i];
-    }
-    length = c;
-    
-    /* Insert the checksum and the end control. */
-    buffer[length++] = checksum;
-    buffer[length++] = ETX;
+    /* Frame, escape and checksum the response the same way the host does */
+    length = an851_encode(internal[0], &internal[1], length - 1, buffer);
     
     tx_packets++;
         
@@ -357,27 +454,55 @@ void cleanup( int sig )
     exit(0);
 }
 static struct option anopts[] = {
-    { "hex",      required_argument, NULL, 'x' },
-    { "serial",   required_argument, NULL, 's' },
-    { "devid",    required_argument, NULL, 'd' },
-    { "version",  required_argument, NULL, 'v' },
-    { "devlist",  required_argument, NULL, 'l' },
-    { "no-ifi",   no_argument,       NULL, 'i' },
+    { "caps",     required_argument, NULL, 'c' },
     { "help",     no_argument,       NULL, 'h' },
     { NULL,       0,                 NULL, 0   }
 };
+
+static void usage( const char *prog )
+{
+    printf("Usage: %s [--caps=MASK]\n"
+           "Simulate an AN851 bootloader on a new pseudo-terminal.\n"
+           "  -c, --caps=MASK  AN851_CAP_* flags of the extensions to "
+           "announce\n"
+           "                   (default 0x%02X; 0 for plain AN851)\n"
+           "  -h, --help       Show these options.\n",
+           prog, AN851D_CAPS);
+}
+
 int main( int argc, char **argv )
 {
-#if 0
     int c;
-    while((c = getopt_long(argc, argv, "x:d:v:l:ih",
-           longopts, NULL)) != -1) {
+    long mask;
+    char *end;
+    
+    while((c = getopt_long(argc, argv, "c:h", anopts, NULL)) != -1) {
         switch (c) {
-            case 'x':
-                printf("Loading with initial HEX file: %s\n", optarg);
-#endif
+            case 'c':
+                mask = strtol(optarg, &end, 0);
+                if(*optarg == '\0' || *end != '\0' || mask < 0 ||
+                   mask > 0xFF) {
+                    rigel_error("invalid capability mask %s!\n", optarg);
+                    return 1;
+                }
+                caps = mask;
+                break;
+                
+            case 'h':
+                usage(argv[0]);
+                return 0;
+                
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind < argc) {
+        usage(argv[0]);
+        return 1;
+    }
 
     signal(SIGINT, cleanup);
-    an851d_initialize( argv[1], NULL );
+    an851d_initialize( NULL, NULL );
     return 0;
 }
@@ -6,6 +6,8 @@
 
 #define AN851D_VERSION 0x1439
 #define AN851D_DEVID   0x1420 /* PIC18F8722 */
+#define AN851D_CAPS    (AN851_CAP_CRC | AN851_CAP_WRSUM | AN851_CAP_RANGE)
+                       /* Extensions, unless --caps says otherwise */
 
 #define INTERNAL_BUFFER_SIZE 255
 
@@ -17,12 +19,16 @@ int an851d_version(void);
 int an851d_rd_flash (dword address, byte length);
 int an851d_rd_eeprom(dword address, byte length);
 int an851d_rd_config(dword address, byte length);
+int an851d_rd_crc   (dword address, byte blocks, byte count);
+int an851d_set_mode (byte flags);
+int an851d_rd_range (dword address, dword length, byte chunk);
 
 int an851d_wr_flash (dword address, byte blocks, void *data);
 int an851d_wr_eeprom(word address,  byte length, void *data);
 int an851d_wr_config(byte confaddr, byte length, void *data);
 
 int an851d_er_flash(dword address, byte rows);
+int an851d_ifi_wr_row(dword address, byte rows, byte val);
 
 int an851d_repeat(void);
 int an851d_replicate_write(byte write_command, byte length, dword address);
@@ -6,12 +6,18 @@
 #include <getopt.h>
 
 #include <inhex32.h>
+#include <cache.h>
+#include <rimage.h>
+#include <script.h>
 
 #define HEXTOOL_MAJOR_VER 0
 #define HEXTOOL_MINOR_VER 2
 
 #define MAX_PROGRAM_SIZE 0x20000
 
+/* Boot block of IFI controllers (BBSIZ = 00b) */
+#define DEFAULT_BOOT_SIZE 0x800
+
 extern int optopt, optind;
 extern char *optarg;
 
@@ -19,26 +25,50 @@ static struct option longopts[] = {
 	{"hex2bin", no_argument, NULL, 'h'},
 	{"hex2raw", no_argument, NULL, 'r'},
 	{"bin2hex", no_argument, NULL, 'b'},
+	{"hex2img", no_argument, NULL, 'i'},
+	{"img2hex", no_argument, NULL, 'x'},
+	{"hex2script", no_argument, NULL, 's'},
+	{"ifi", no_argument, NULL, 'I'},
+	{"boot", required_argument, NULL, 'B'},
+	{"packet", required_argument, NULL, 'p'},
+	{"devid", required_argument, NULL, 'd'},
 	{"verify", no_argument, NULL, 'v'},
-	{"version", no_argument, NULL, 'w'}
+	{"version", no_argument, NULL, 'w'},
+	{"verbose", no_argument, NULL, 'V'},
+	{NULL, 0, NULL, 0}
 };
 
 int hex2raw(const char *hex, const char *raw)
 {
 	uint32_t start, end;
 	uint8_t *buffer;
+	struct image *img;
 	FILE *out;
 
 	printf("Converting INHEX32 format file %s to IFI BIN format.\n", hex);
 
-	buffer = (uint8_t *) malloc(MAX_PROGRAM_SIZE);
-	memset(buffer, 0xFF, MAX_PROGRAM_SIZE);
-
-	if (inhex32_read(hex, buffer, MAX_PROGRAM_SIZE, &start, &end) == -1) {
+	if (!(img = cache_read(hex, IntelHexFormat, inhex32_read))) {
 		fprintf(stderr, "Error reading input file! Aborting.\n\n");
 		exit(1);
 	}
 
+	/* The raw image runs from address 0 to the end of the program;
+	 * configuration data is left out. */
+	if (image_bounds(img, MAX_PROGRAM_SIZE, CONFIG_REGISTER_MASK,
+			 &start, &end)) {
+		fprintf(stderr, "Program too large for a raw image! "
+			"Aborting.\n\n");
+		exit(1);
+	}
+	if (!image_bounds(img, 0, MAX_PROGRAM_SIZE, &start, &end))
+		end = 0;
+
+	if (!(buffer = (uint8_t *) malloc(end + 1))) {
+		fprintf(stderr, "could not malloc %" PRIu32 " bytes\n", end);
+		exit(1);
+	}
+	image_get(img, 0, buffer, end);
+
 	if (!(out = fopen(raw, "wb"))) {
 		fprintf(stderr, "Error creating output file %s.\n\n", raw);
 		return -1;
@@ -53,6 +83,7 @@ int hex2raw(const char *hex, const char *raw)
 	fclose(out);
 
 	free(buffer);
+	image_free(img);
 
 	printf("Successfully converted %s to %s!\n\n", hex, raw);
 
@@ -61,38 +92,106 @@ int hex2raw(const char *hex, const char *raw)
 
 int bin2hex(const char *bin, const char *hex)
 {
-	uint8_t *buffer;
+	struct image *img;
 	uint32_t start, end;
 
 	printf("Converting IFI BIN file %s to an INHEX32 format program.\n",
 	       bin);
 
-	int ret = ifi_bin_read(bin, NULL, 0xFFFFF, &start, &end);
-	if (ret < 0) {
-		fprintf(stderr, "ifi_bin_read [size] failed\n");
+	if (!(img = cache_read(bin, InnovationFirstFormat, ifi_bin_read))) {
+		fprintf(stderr, "ifi_bin_read failed\n");
 		exit(1);
 	}
-	printf("s: %.06X e: %.06X\n", start, end);
+	if (image_bounds(img, 0, UINT32_MAX, &start, &end))
+		printf("s: %.06X e: %.06X\n", start, end);
 
-	buffer = (uint8_t *) malloc(end);
-	if (!buffer) {
-		fprintf(stderr, "could not malloc %"PRIu32" bytes\n", end);
+	if (inhex32_write(hex, img) == -1) {
+		fprintf(stderr, "Error writing output file! Aborting.\n\n");
 		exit(1);
 	}
-	memset(buffer, 0xFF, end);
-	ret = ifi_bin_read(bin, buffer, end, &start, &end);
-	if (ret < 0) {
-		fprintf(stderr, "ifi_bin_read [real] failed\n");
+
+	image_free(img);
+	printf("Successfully converted %s to %s!\n\n", bin, hex);
+
+	return 0;
+}
+
+/* Convert between INHEX32 and rigel's native image format. The image is
+ * not tied to a device, so rigel will load it onto any. */
+int hex2img(const char *hex, const char *rimg)
+{
+	struct image *img;
+
+	printf("Converting INHEX32 format file %s to a rigel image.\n", hex);
+
+	if (!(img = cache_read(hex, IntelHexFormat, inhex32_read))) {
+		fprintf(stderr, "Error reading input file! Aborting.\n\n");
 		exit(1);
 	}
+	if (rimage_write(rimg, img, 0) == -1) {
+		fprintf(stderr, "Error writing output file! Aborting.\n\n");
+		exit(1);
+	}
+
+	image_free(img);
+	printf("Successfully converted %s to %s!\n\n", hex, rimg);
 
-	if (inhex32_write(hex, buffer, start, end) == -1) {
+	return 0;
+}
+
+int img2hex(const char *rimg, const char *hex)
+{
+	struct image *img;
+
+	printf("Converting rigel image %s to an INHEX32 format program.\n",
+	       rimg);
+
+	if (!(img = image_alloc(0xFF)) || rimage_read(rimg, img) == -1) {
+		fprintf(stderr, "Error reading input file! Aborting.\n\n");
+		exit(1);
+	}
+	if (inhex32_write(hex, img) == -1) {
 		fprintf(stderr, "Error writing output file! Aborting.\n\n");
 		exit(1);
 	}
 
-	free(buffer);
-	printf("Successfully converted %s to %s!\n\n", bin, hex);
+	image_free(img);
+	printf("Successfully converted %s to %s!\n\n", rimg, hex);
+
+	return 0;
+}
+
+/* The device a flash script is compiled for, set by --ifi, --boot and
+ * --devid. The script is checked against the real device when it is
+ * run. */
+static struct device target = {
+	.mem = {
+		.flash_low = DEFAULT_BOOT_SIZE,
+		.flash_high = MAX_PROGRAM_SIZE - 1,
+		.config_low = CONFIG_REGISTER_MASK,
+	},
+};
+static uint8_t packet_size = DEVICE_MAX_WRITE;
+
+int hex2script(const char *hex, const char *script)
+{
+	struct image *img;
+
+	printf("Compiling INHEX32 format file %s into a flash script for\n"
+	       "%s devices with a %d byte boot block.\n", hex,
+	       target.is_ifi ? "IFI" : "non-IFI", target.mem.flash_low);
+
+	if (!(img = cache_read(hex, IntelHexFormat, inhex32_read))) {
+		fprintf(stderr, "Error reading input file! Aborting.\n\n");
+		exit(1);
+	}
+	if (script_compile(script, &target, img, packet_size) == -1) {
+		fprintf(stderr, "Error writing output file! Aborting.\n\n");
+		exit(1);
+	}
+
+	image_free(img);
+	printf("Successfully compiled %s to %s!\n\n", hex, script);
 
 	return 0;
 }
@@ -101,7 +200,7 @@ int main(int argc, char **argv)
 {
 	char ch;
 
-	while ((ch = getopt_long(argc, argv, "hbrv", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "hbrixsIB:p:d:vV", longopts, NULL)) != -1) {
 		switch (ch) {
 
 		case 'r':
@@ -114,6 +213,37 @@ int main(int argc, char **argv)
 				goto usage;
 			return bin2hex(argv[optind], argv[optind + 1]);
 
+		case 'i':
+			if (argc - optind < 2)
+				goto usage;
+			return hex2img(argv[optind], argv[optind + 1]);
+
+		case 'x':
+			if (argc - optind < 2)
+				goto usage;
+			return img2hex(argv[optind], argv[optind + 1]);
+
+		case 's':
+			if (argc - optind < 2)
+				goto usage;
+			return hex2script(argv[optind], argv[optind + 1]);
+
+		case 'I':
+			target.is_ifi = 1;
+			break;
+
+		case 'B':
+			target.mem.flash_low = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'p':
+			packet_size = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'd':
+			target.dev_id = strtoul(optarg, NULL, 0);
+			break;
+
 		case 'v':
 			if (inhex32_validate(argv[optind]) == -1) {
 				printf("HEX file specified is NOT valid.\n");
@@ -122,6 +252,10 @@ int main(int argc, char **argv)
 
 			return 0;
 
+		case 'V':
+			ifi_bin_verbose = 1;
+			break;
+
 		case 'w':
 			printf
 			    ("Rigel INHEX32 conversion utility, version %d.%d.\n",
@@ -137,7 +271,11 @@ int main(int argc, char **argv)
 
  usage:
 	printf("Rigel HEX conversion utility, version %d.%d.\n"
-	       "Usage: %s [--bin2hex] [--hex2bin] [--verify] infile [outfile]\n",
+	       "Usage: %s [--verbose] [--bin2hex] [--hex2bin] [--hex2img] "
+	       "[--img2hex] [--verify] "
+	       "[--ifi] [--boot=BYTES] [--packet=BYTES] [--devid=ID] "
+	       "[--hex2script] "
+	       "infile [outfile]\n",
 	       HEXTOOL_MAJOR_VER, HEXTOOL_MINOR_VER, argv[0]);
 
 	return 0;